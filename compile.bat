@@ -1,6 +1,6 @@
 @echo off
 echo Compiling gravity simulation...
-g++ -g -std=c++17 -I./include -L./lib src/main.cpp src/glad.c -lglfw3dll -o gravity_sim.exe
+g++ -g -O2 -fno-math-errno -std=c++17 -I./include -L./lib src/main.cpp src/glad.c -lglfw3dll -o gravity_sim.exe
 if %ERRORLEVEL% == 0 (
     echo Compilation successful! Run with: gravity_sim.exe
 ) else (
@@ -0,0 +1,419 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "funnel.h"
+#include "memory_stats.h"
+#include "profiler.h"
+
+// The funnel as an adaptive quadtree mesh over [-size, size]^2: flat far
+// field stays coarse while cells around the wells are split down to
+// maxLevel. A leaf splits when its center or an edge midpoint is more than
+// tolerance away from the bilinear surface through its corners, and four
+// sibling leaves merge back once their parent is within tolerance / 2 (the
+// gap keeps cells from flapping).
+//
+// The tree is kept 2:1 balanced, so a leaf edge borders at most two finer
+// leaves; such a leaf is triangulated as a fan through its center that
+// includes the edge midpoint, which is exactly the neighbors' shared vertex,
+// so there are no cracks. Other leaves are two triangles.
+//
+// Updates are incremental, as in FunnelSurface. Heights are cached in a flat
+// array over the finest grid, 2^maxLevel cells across, computed from where
+// the surface last saw each body. A body that moved more than moveTolerance
+// (or changed mass) marks stale every cached height within its reach, the
+// distance beyond which it lowers the surface by less than heightEpsilon,
+// around its old and new position. A cell's split or merge test reads only
+// its nine sample heights, so only cells with a stale sample are tested
+// again. The mesh is rebuilt only when the tree changes; otherwise the
+// vertices whose heights went stale are refreshed and uploaded in place.
+class AdaptiveFunnel {
+public:
+    int minLevel = 3;
+    int maxLevel = 8;
+    float tolerance = 0.5f;
+    float moveTolerance = 0.5f;
+    float heightEpsilon = 0.01f;
+
+    explicit AdaptiveFunnel(float size) : size(size) {
+        nodes.push_back({ 0, 0, 0, -1 });
+    }
+
+    size_t Triangles() const { return indices.size() / 3; }
+
+    void Update(const glm::vec3* pos, const float* mass, size_t n) {
+        ProfileScope profile("funnel");
+        ++update;
+        size_t side = Side(), points = side * side;
+        bool resized = heights.size() != points;
+        if (resized) {
+            // Everything at its largest possible size, so a finer mesh
+            // never reallocates mid-run: a leaf at any level yields at most
+            // as many triangles as the finest cells it covers would.
+            size_t finest = (size_t)1 << (2 * maxLevel);
+            heights.assign(points, 0.0f);
+            meshSlot.assign(points, 0);
+            meshStamp.assign(points, 0);
+            nodes.reserve(finest / 3 * 4 + 1);
+            freeBlocks.reserve(finest / 3 + 1);
+            pending.reserve(3 * finest); // Balance() may queue a leaf again per split
+            unevaluated.reserve(finest / 3 * 4 + 1);
+            vertices.reserve(points);
+            vertexKeys.reserve(points);
+            indices.reserve(6 * finest);
+        }
+        bool full = resized || n != bx.size();
+        if (full) {
+            stale.assign(points, 1);
+            staleSince.assign(points, update);
+            bx.resize(n);
+            bz.resize(n);
+            bk.resize(n);
+        }
+        bool moved = full;
+        for (size_t b = 0; b < n; ++b) {
+            float k = mass[b] * funnelScale;
+            float dx = pos[b].x - bx[b], dz = pos[b].z - bz[b];
+            if (full || dx * dx + dz * dz > moveTolerance * moveTolerance || k != bk[b]) {
+                if (!full) MarkStale(bx[b], bz[b], bk[b]);
+                bx[b] = pos[b].x;
+                bz[b] = pos[b].z;
+                bk[b] = k;
+                if (!full) MarkStale(bx[b], bz[b], k);
+                moved = true;
+            }
+        }
+        if (!moved) return;
+
+        // Split where the surface is under-resolved, testing the leaves
+        // whose samples changed
+        bool topologyChanged = false;
+        pending.clear();
+        for (int32_t i = 0; i < (int32_t)nodes.size(); ++i)
+            if (nodes[i].level >= 0 && nodes[i].child < 0 && Touched(nodes[i])) pending.push_back(i);
+        topologyChanged |= Refine();
+
+        // Merge parents of four leaves that no longer need them; a merge
+        // can make the grandparent mergeable, whatever its samples did
+        for (int32_t i = 0; i < (int32_t)nodes.size(); ++i) {
+            if (nodes[i].level < minLevel || !LeafChildren(nodes[i]) || !Touched(nodes[i])) continue;
+            for (int32_t m = i; Error(nodes[m]) < 0.5f * tolerance;) {
+                Merge(m);
+                topologyChanged = true;
+                const Node& node = nodes[m];
+                if (node.level <= minLevel) break;
+                m = Find(node.level - 1, node.ix >> 1, node.iz >> 1);
+                if (!LeafChildren(nodes[m])) break;
+            }
+        }
+
+        if (topologyChanged) {
+            // Leaves that balancing creates get the error test as well
+            for (;;) {
+                Balance();
+                if (unevaluated.empty()) break;
+                pending.swap(unevaluated);
+                unevaluated.clear();
+                if (!Refine()) break;
+            }
+            Triangulate();
+            uploadAll = true;
+            return;
+        }
+        for (size_t v = 0; v < vertices.size(); ++v) {
+            uint32_t key = vertexKeys[v];
+            if (staleSince[key] != update) continue;
+            vertices[v].y = Height(key);
+            uploadLo = std::min(uploadLo, v);
+            uploadHi = std::max(uploadHi, v + 1);
+        }
+    }
+
+    // Draws the mesh in wireframe with whatever program is bound; vertices
+    // are at attribute location 0.
+    void Draw() {
+        if (!vao) {
+            glGenVertexArrays(1, &vao);
+            glBindVertexArray(vao);
+            glGenBuffers(1, &vbo);
+            glGenBuffers(1, &ibo);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        }
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        if (uploadAll) {
+            if (vertices.size() > vertexCapacity) {
+                vertexCapacity = vertices.size() + vertices.size() / 2;
+                glBufferData(GL_ARRAY_BUFFER, vertexCapacity * sizeof(glm::vec3), nullptr, GL_DYNAMIC_DRAW);
+            }
+            if (indices.size() > indexCapacity) {
+                indexCapacity = indices.size() + indices.size() / 2;
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
+            }
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indices.size() * sizeof(GLuint), indices.data());
+            uploadLo = 0;
+            uploadHi = vertices.size();
+            uploadAll = false;
+        }
+        if (uploadLo < uploadHi) {
+            glBufferSubData(GL_ARRAY_BUFFER, uploadLo * sizeof(glm::vec3), (uploadHi - uploadLo) * sizeof(glm::vec3),
+                            vertices.data() + uploadLo);
+            uploadLo = SIZE_MAX;
+            uploadHi = 0;
+        }
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        {
+            DriverCallScope driver;
+            glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, nullptr);
+        }
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+private:
+    // Cell (ix, iz) of the 2^level x 2^level grid at that level. Freed
+    // nodes have level -1.
+    struct Node {
+        int level;
+        uint32_t ix, iz;
+        int32_t child; // first of four consecutive children, -1 for leaves
+    };
+
+    // Vertices are addressed on the finest grid, 2^maxLevel cells across.
+    uint32_t Shift(int level) const { return (uint32_t)(maxLevel - level); }
+
+    uint32_t Side() const { return (1u << maxLevel) + 1; }
+    uint32_t Key(uint32_t X, uint32_t Z) const { return Z * Side() + X; }
+
+    float Height(uint32_t X, uint32_t Z) { return Height(Key(X, Z)); }
+
+    float Height(uint32_t key) {
+        if (!stale[key]) return heights[key];
+        float x = Coord(key % Side()), z = Coord(key / Side()), h = 0.0f;
+        for (size_t b = 0; b < bx.size(); ++b) {
+            float dx = x - bx[b], dz = z - bz[b];
+            h -= std::min(bk[b] / (dx * dx + dz * dz + 1.0f), funnelDepthMax);
+        }
+        heights[key] = h;
+        stale[key] = 0;
+        return h;
+    }
+
+    float Coord(uint32_t X) const { return -size + 2.0f * size * (float)X / (float)(1u << maxLevel); }
+
+    // Marks stale the cached heights a body at (x, z) lowers by
+    // heightEpsilon or more; the reach is that of FunnelSurface.
+    void MarkStale(float x, float z, float k) {
+        float reach = std::sqrt(std::max(k / heightEpsilon - 1.0f, 0.0f));
+        float perCell = (float)(1u << maxLevel) / (2.0f * size), last = (float)(Side() - 1);
+        auto lo = [&](float c) { return (uint32_t)std::min(std::max(std::floor((c - reach + size) * perCell), 0.0f), last); };
+        auto hi = [&](float c) { return (uint32_t)std::min(std::max(std::ceil((c + reach + size) * perCell), 0.0f), last); };
+        if (x + reach < -size || x - reach > size || z + reach < -size || z - reach > size) return;
+        uint32_t x0 = lo(x), x1 = hi(x), z0 = lo(z), z1 = hi(z);
+        for (uint32_t Z = z0; Z <= z1; ++Z) {
+            for (uint32_t X = x0; X <= x1; ++X) {
+                stale[Key(X, Z)] = 1;
+                staleSince[Key(X, Z)] = update;
+            }
+        }
+    }
+
+    // True when one of the samples Error() reads went stale in this update.
+    bool Touched(const Node& node) const {
+        uint32_t s = Shift(node.level), x0 = node.ix << s, z0 = node.iz << s;
+        uint32_t m = (1u << s) / 2;
+        if (m == 0) return false;
+        for (uint32_t Z = z0; Z <= z0 + 2 * m; Z += m)
+            for (uint32_t X = x0; X <= x0 + 2 * m; X += m)
+                if (staleSince[Key(X, Z)] == update) return true;
+        return false;
+    }
+
+    bool LeafChildren(const Node& node) const {
+        if (node.child < 0) return false;
+        for (int k = 0; k < 4; ++k)
+            if (nodes[node.child + k].child >= 0) return false;
+        return true;
+    }
+
+    // Largest distance of the center and edge midpoints from the bilinear
+    // surface through the corners. Only defined below maxLevel.
+    float Error(const Node& node) {
+        uint32_t s = Shift(node.level), x0 = node.ix << s, z0 = node.iz << s;
+        uint32_t w = 1u << s, m = w / 2;
+        float h00 = Height(x0, z0), h10 = Height(x0 + w, z0), h01 = Height(x0, z0 + w), h11 = Height(x0 + w, z0 + w);
+        float e = std::abs(Height(x0 + m, z0 + m) - 0.25f * (h00 + h10 + h01 + h11));
+        e = std::max(e, std::abs(Height(x0 + m, z0) - 0.5f * (h00 + h10)));
+        e = std::max(e, std::abs(Height(x0 + m, z0 + w) - 0.5f * (h01 + h11)));
+        e = std::max(e, std::abs(Height(x0, z0 + m) - 0.5f * (h00 + h01)));
+        e = std::max(e, std::abs(Height(x0 + w, z0 + m) - 0.5f * (h10 + h11)));
+        return e;
+    }
+
+    int32_t Split(int32_t i) {
+        int32_t c;
+        if (!freeBlocks.empty()) {
+            c = freeBlocks.back();
+            freeBlocks.pop_back();
+        } else {
+            c = (int32_t)nodes.size();
+            nodes.resize(nodes.size() + 4);
+        }
+        Node node = nodes[i];
+        for (int k = 0; k < 4; ++k)
+            nodes[c + k] = { node.level + 1, node.ix * 2 + (k & 1), node.iz * 2 + (k >> 1), -1 };
+        nodes[i].child = c;
+        return c;
+    }
+
+    void Merge(int32_t i) {
+        int32_t c = nodes[i].child;
+        for (int k = 0; k < 4; ++k) nodes[c + k].level = -1;
+        freeBlocks.push_back(c);
+        nodes[i].child = -1;
+    }
+
+    // Deepest node at or above `level` that contains cell (ix, iz) of that
+    // level.
+    int32_t Find(int level, uint32_t ix, uint32_t iz) const {
+        int32_t i = 0;
+        while (nodes[i].level < level && nodes[i].child >= 0) {
+            int shift = level - nodes[i].level - 1;
+            int k = (int)((ix >> shift) & 1) | (int)((iz >> shift) & 1) << 1;
+            i = nodes[i].child + k;
+        }
+        return i;
+    }
+
+    // Splits leaves from pending while they are under-resolved, down to
+    // maxLevel; true if any was split.
+    bool Refine() {
+        bool split = false;
+        while (!pending.empty()) {
+            int32_t i = pending.back();
+            pending.pop_back();
+            const Node& node = nodes[i];
+            if (node.level < 0 || node.child >= 0) continue;
+            if (node.level < maxLevel && (node.level < minLevel || Error(node) > tolerance)) {
+                int32_t c = Split(i);
+                for (int k = 0; k < 4; ++k) pending.push_back(c + k);
+                split = true;
+            }
+        }
+        return split;
+    }
+
+    // Splits coarse leaves until every leaf's edge neighbors are at most one
+    // level coarser, collecting the new leaves in unevaluated.
+    void Balance() {
+        pending.clear();
+        for (int32_t i = 0; i < (int32_t)nodes.size(); ++i)
+            if (nodes[i].level >= 2 && nodes[i].child < 0) pending.push_back(i);
+        while (!pending.empty()) {
+            int32_t i = pending.back();
+            pending.pop_back();
+            Node node = nodes[i];
+            if (node.level < 2 || node.child >= 0) continue;
+            uint32_t cells = 1u << node.level;
+            const int dx[4] = { -1, 1, 0, 0 }, dz[4] = { 0, 0, -1, 1 };
+            for (int k = 0; k < 4; ++k) {
+                int64_t nx = (int64_t)node.ix + dx[k], nz = (int64_t)node.iz + dz[k];
+                if (nx < 0 || nz < 0 || nx >= cells || nz >= cells) continue;
+                int32_t n = Find(node.level - 1, (uint32_t)nx >> 1, (uint32_t)nz >> 1);
+                if (nodes[n].level < node.level - 1) {
+                    int32_t c = Split(n);
+                    for (int j = 0; j < 4; ++j) {
+                        pending.push_back(c + j);
+                        unevaluated.push_back(c + j);
+                    }
+                    pending.push_back(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Mesh vertex at a fine-grid point; meshStamp tells whether the point
+    // already has one in the current mesh.
+    uint32_t Vertex(uint32_t X, uint32_t Z) {
+        uint32_t key = Key(X, Z);
+        if (meshStamp[key] == mesh) return meshSlot[key];
+        uint32_t v = (uint32_t)vertices.size();
+        vertices.push_back(glm::vec3(Coord(X), Height(key), Coord(Z)));
+        vertexKeys.push_back(key);
+        meshSlot[key] = v;
+        meshStamp[key] = mesh;
+        return v;
+    }
+
+    // True when the same-level neighbor across an edge has been split.
+    bool Finer(const Node& node, int dx, int dz) const {
+        int64_t nx = (int64_t)node.ix + dx, nz = (int64_t)node.iz + dz, cells = 1ll << node.level;
+        if (nx < 0 || nz < 0 || nx >= cells || nz >= cells) return false;
+        const Node& n = nodes[Find(node.level, (uint32_t)nx, (uint32_t)nz)];
+        return n.level == node.level && n.child >= 0;
+    }
+
+    void Triangulate() {
+        ++mesh;
+        vertices.clear();
+        vertexKeys.clear();
+        indices.clear();
+        for (const Node& node : nodes) {
+            if (node.level < 0 || node.child >= 0) continue;
+            uint32_t s = Shift(node.level), x0 = node.ix << s, z0 = node.iz << s;
+            uint32_t w = 1u << s, m = w / 2;
+            uint32_t v00 = Vertex(x0, z0), v10 = Vertex(x0 + w, z0);
+            uint32_t v11 = Vertex(x0 + w, z0 + w), v01 = Vertex(x0, z0 + w);
+            bool south = Finer(node, 0, -1), east = Finer(node, 1, 0);
+            bool north = Finer(node, 0, 1), west = Finer(node, -1, 0);
+            if (!(south || east || north || west)) {
+                indices.insert(indices.end(), { v00, v10, v11, v00, v11, v01 });
+                continue;
+            }
+            // Boundary loop with the midpoints of edges that border finer leaves
+            uint32_t ring[8];
+            int count = 0;
+            ring[count++] = v00;
+            if (south) ring[count++] = Vertex(x0 + m, z0);
+            ring[count++] = v10;
+            if (east) ring[count++] = Vertex(x0 + w, z0 + m);
+            ring[count++] = v11;
+            if (north) ring[count++] = Vertex(x0 + m, z0 + w);
+            ring[count++] = v01;
+            if (west) ring[count++] = Vertex(x0, z0 + m);
+            uint32_t center = Vertex(x0 + m, z0 + m);
+            for (int k = 0; k < count; ++k)
+                indices.insert(indices.end(), { center, ring[k], ring[(k + 1) % count] });
+        }
+    }
+
+    float size;
+    std::vector<Node> nodes;
+    std::vector<int32_t> freeBlocks, pending;
+    std::vector<int32_t> unevaluated; // leaves made by Balance(), not yet error tested
+    std::vector<float> bx, bz, bk;    // bodies as the surface last saw them
+
+    // Per fine-grid point, indexed by Key()
+    uint32_t update = 0, mesh = 0;
+    std::vector<float> heights;
+    std::vector<char> stale;
+    std::vector<uint32_t> staleSince; // update that last marked the height stale
+    std::vector<uint32_t> meshSlot, meshStamp;
+
+    std::vector<glm::vec3> vertices;
+    std::vector<uint32_t> vertexKeys; // fine-grid point of each vertex
+    std::vector<GLuint> indices;
+    GLuint vao = 0, vbo = 0, ibo = 0;
+    size_t vertexCapacity = 0, indexCapacity = 0;
+    bool uploadAll = false;
+    size_t uploadLo = SIZE_MAX, uploadHi = 0; // vertices awaiting upload
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// Bump allocator for temporaries that live no longer than a step.
+//
+// Allocation moves a pointer through the current chunk and never frees;
+// Rewind() returns to an earlier GetMark() and Reset() to the start. When a
+// chunk runs out the next one is twice as large. Reset() keeps the largest
+// chunk if it could have held the whole step, and otherwise folds all of
+// them into one chunk of their combined size, so after the first few steps
+// a step that asks for the same amount of memory as before never allocates.
+// Chunks come from operator new, so the allocation counters of
+// memory_stats.h see the arena grow.
+//
+// Builds with ARENA_POISON defined overwrite released memory with 0xCD,
+// which makes a container that outlived its step show garbage instead of
+// stale values.
+class Arena {
+public:
+    struct Mark {
+        size_t chunk, offset;
+    };
+
+    struct Stats {
+        size_t capacity = 0; // bytes in all chunks
+        size_t peak = 0;     // most bytes in use at once
+        size_t chunks = 0;   // chunk allocations so far
+    };
+
+    explicit Arena(size_t initialBytes = 64 * 1024) : initialBytes(initialBytes) {}
+    ~Arena() {
+        for (Chunk& c : chunks) ::operator delete(c.data);
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* Allocate(size_t bytes, size_t align) {
+        for (;;) {
+            if (chunk < chunks.size()) {
+                const Chunk& c = chunks[chunk];
+                uintptr_t base = (uintptr_t)c.data;
+                size_t at = (size_t)(((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base);
+                if (at + bytes <= c.size) {
+                    offset = at + bytes;
+                    stepPeak = std::max(stepPeak, InUse());
+                    stats.peak = std::max(stats.peak, stepPeak);
+                    return c.data + at;
+                }
+                if (chunk + 1 < chunks.size()) {
+                    ++chunk;
+                    offset = 0;
+                    continue;
+                }
+            }
+            size_t size = std::max(chunks.empty() ? initialBytes : 2 * chunks.back().size, bytes + align);
+            AddChunk(size);
+            chunk = chunks.size() - 1;
+            offset = 0;
+        }
+    }
+
+    Mark GetMark() const { return { chunk, offset }; }
+
+    void Rewind(Mark mark) {
+        Poison(mark);
+        chunk = mark.chunk;
+        offset = mark.offset;
+    }
+
+    void Reset() {
+        Rewind({ 0, 0 });
+        size_t needed = stepPeak;
+        stepPeak = 0;
+        if (chunks.size() <= 1) return;
+        std::swap(chunks[0], *std::max_element(chunks.begin(), chunks.end(),
+                                                [](const Chunk& a, const Chunk& b) { return a.size < b.size; }));
+        size_t total = stats.capacity, kept = chunks[0].size >= needed ? 1 : 0;
+        for (size_t k = kept; k < chunks.size(); ++k) {
+            ::operator delete(chunks[k].data);
+            stats.capacity -= chunks[k].size;
+        }
+        chunks.resize(kept);
+        if (!kept) AddChunk(total);
+    }
+
+    size_t InUse() const {
+        size_t bytes = offset;
+        for (size_t k = 0; k < chunk && k < chunks.size(); ++k) bytes += chunks[k].size;
+        return bytes;
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct Chunk {
+        char* data;
+        size_t size;
+    };
+
+    void AddChunk(size_t size) {
+        chunks.push_back({ static_cast<char*>(::operator new(size)), size });
+        stats.capacity += size;
+        ++stats.chunks;
+    }
+
+    void Poison(Mark mark) {
+#ifdef ARENA_POISON
+        for (size_t k = mark.chunk; k <= chunk && k < chunks.size(); ++k) {
+            size_t from = k == mark.chunk ? mark.offset : 0, to = k == chunk ? offset : chunks[k].size;
+            if (to > from) std::memset(chunks[k].data + from, 0xCD, to - from);
+        }
+#else
+        (void)mark;
+#endif
+    }
+
+    size_t initialBytes;
+    std::vector<Chunk> chunks;
+    size_t chunk = 0, offset = 0;
+    size_t stepPeak = 0; // most bytes in use since the last Reset()
+    Stats stats;
+};
+
+// Releases everything allocated from the arena during its lifetime.
+class ArenaScope {
+public:
+    explicit ArenaScope(Arena& arena) : arena(arena), mark(arena.GetMark()) {}
+    ~ArenaScope() { arena.Rewind(mark); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    Arena& arena;
+    Arena::Mark mark;
+};
+
+// Standard allocator on an arena. deallocate() is a no-op: the memory comes
+// back when the arena is rewound, so a container must not outlive that.
+template <class T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Stable reference to a body. Ids are dense, so removing a body renames
+// another one; a handle keeps naming the same body until that body is
+// removed, and is stale from then on instead of silently pointing at
+// whatever reuses its slot.
+struct BodyHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool operator==(const BodyHandle& o) const { return index == o.index && generation == o.generation; }
+    bool operator!=(const BodyHandle& o) const { return !(*this == o); }
+};
+
+// Slot map from handles to dense ids [0, Size()). Slots of removed bodies
+// go on a free list and are reused with a bumped generation, so adding,
+// removing and resolving a handle are all O(1).
+class BodyHandles {
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    size_t Size() const { return handleOf.size(); }
+
+    // Registers the body that was just given id Size().
+    BodyHandle Add() {
+        uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            index = (uint32_t)slots.size();
+            slots.push_back({ 0, 0 });
+            freeSlots.reserve(slots.capacity()); // so Remove() never allocates
+        }
+        slots[index].id = handleOf.size();
+        handleOf.push_back(index);
+        return { index, slots[index].generation };
+    }
+
+    // Id of the body, or npos if it has been removed.
+    size_t Id(BodyHandle h) const {
+        if (h.index >= slots.size() || slots[h.index].generation != h.generation) return npos;
+        return slots[h.index].id;
+    }
+
+    BodyHandle Handle(size_t id) const {
+        uint32_t index = handleOf[id];
+        return { index, slots[index].generation };
+    }
+
+    // Retires the body with this id; the body with the highest id takes it
+    // over, matching a swap-remove on arrays indexed by id.
+    void Remove(size_t id) {
+        uint32_t index = handleOf[id];
+        ++slots[index].generation;
+        freeSlots.push_back(index);
+        handleOf[id] = handleOf.back();
+        slots[handleOf[id]].id = id;
+        handleOf.pop_back();
+    }
+
+private:
+    struct Slot {
+        size_t id;
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> handleOf; // slot of each id
+    std::vector<uint32_t> freeSlots;
+};
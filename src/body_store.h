@@ -0,0 +1,150 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "space.h"
+
+// How a body moves. Only dynamic bodies receive forces and get integrated;
+// the others are pure sources of gravity.
+enum class Motion {
+    Dynamic,
+    Static,     // anchored in place
+    Prescribed  // follows a CircularPath
+};
+
+// Analytic motion on a circle around center in the x/z plane.
+struct CircularPath {
+    glm::vec3 center;
+    float radius;
+    float angularSpeed;
+    float phase;
+
+    glm::vec3 PositionAt(float t) const {
+        float a = angularSpeed * t + phase;
+        return center + radius * glm::vec3(cosf(a), 0.0f, sinf(a));
+    }
+
+    glm::vec3 VelocityAt(float t) const {
+        float a = angularSpeed * t + phase;
+        return radius * angularSpeed * glm::vec3(-sinf(a), 0.0f, cosf(a));
+    }
+};
+
+// Simulation state of all bodies, one array per field (structure of arrays)
+// so kernels stream through exactly the data they use.
+//
+// Slots are partitioned: dynamic bodies occupy [0, numDynamic), static and
+// prescribed ones the rest, so kernels skip non-receivers through their loop
+// bounds instead of a per-body test. Since adding a dynamic body can move a
+// static one, callers refer to bodies by the id Add() returns; id[] and
+// slot[] translate between the two. Ids are dense as well: Remove() hands
+// the highest id to the body that took the removed one's place in id order,
+// so arrays indexed by id follow with a plain swap-remove.
+template <class Space>
+struct BodyStore {
+    using Vec = typename Space::Vec;
+
+    struct PathBody {
+        size_t id;
+        CircularPath path;
+    };
+
+    std::vector<Vec> position;
+    std::vector<Vec> velocity;
+    std::vector<float> mass;
+    std::vector<size_t> id;   // id of the body in each slot
+    std::vector<size_t> slot; // slot of each id
+    size_t numDynamic = 0;
+    std::vector<PathBody> paths;
+    float time = 0.0f;
+
+    size_t Size() const { return mass.size(); }
+
+    size_t Add(const Vec& p, const Vec& v, float m, Motion motion = Motion::Dynamic) {
+        size_t newId = slot.size();
+        position.push_back(p);
+        velocity.push_back(motion == Motion::Static ? Vec(0.0f) : v);
+        mass.push_back(m);
+        id.push_back(newId);
+        slot.push_back(Size() - 1);
+        if (motion == Motion::Dynamic) {
+            Swap(Size() - 1, numDynamic);
+            ++numDynamic;
+        }
+        return newId;
+    }
+
+    size_t AddPrescribed(const CircularPath& path, float m) {
+        size_t newId = Add(Space::FromWorld(path.PositionAt(time)), Space::FromWorld(path.VelocityAt(time)),
+                           m, Motion::Prescribed);
+        paths.push_back({ newId, path });
+        return newId;
+    }
+
+    // Removes a body in O(1) apart from a scan over the (few) prescribed
+    // bodies. Its slot is refilled from the end of its partition and that
+    // slot from the end of the store, so both partitions stay dense; then
+    // the body with the highest id is renamed to the removed id.
+    void Remove(size_t removedId) {
+        size_t s = slot[removedId];
+        if (s < numDynamic) {
+            Swap(s, numDynamic - 1);
+            s = --numDynamic;
+        }
+        Swap(s, Size() - 1);
+        position.pop_back();
+        velocity.pop_back();
+        mass.pop_back();
+        id.pop_back();
+
+        size_t lastId = slot.size() - 1;
+        for (size_t k = 0; k < paths.size();) {
+            if (paths[k].id == removedId) {
+                paths[k] = paths.back();
+                paths.pop_back();
+                continue;
+            }
+            if (paths[k].id == lastId) paths[k].id = removedId;
+            ++k;
+        }
+        if (removedId != lastId) {
+            slot[removedId] = slot[lastId];
+            id[slot[removedId]] = removedId;
+        }
+        slot.pop_back();
+    }
+
+    // Semi-implicit Euler for the dynamic bodies: kick velocities with the
+    // forces (numDynamic of them), then drift.
+    void Integrate(const Vec* forces, float dt) {
+        for (size_t i = 0; i < numDynamic; ++i) {
+            Vec acceleration = forces[i] / mass[i];
+            velocity[i] += acceleration * dt;
+            position[i] += velocity[i] * dt;
+        }
+    }
+
+    // Moves the clock forward and puts prescribed bodies where their paths
+    // say. Static bodies are never touched.
+    void AdvanceTime(float dt) {
+        time += dt;
+        for (const PathBody& b : paths) {
+            size_t s = slot[b.id];
+            position[s] = Space::FromWorld(b.path.PositionAt(time));
+            velocity[s] = Space::FromWorld(b.path.VelocityAt(time));
+        }
+    }
+
+private:
+    void Swap(size_t a, size_t b) {
+        if (a == b) return;
+        std::swap(position[a], position[b]);
+        std::swap(velocity[a], velocity[b]);
+        std::swap(mass[a], mass[b]);
+        std::swap(id[a], id[b]);
+        slot[id[a]] = a;
+        slot[id[b]] = b;
+    }
+};
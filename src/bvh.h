@@ -0,0 +1,378 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "arena.h"
+#include "frustum.h"
+#include "profiler.h"
+#include "thread_pool.h"
+
+// Bounding-volume hierarchy over body spheres, stored as a flat node array in
+// depth-first order: a node's left child is the next node, its right child
+// is at `right`. Every node covers the contiguous range
+// order[first, first + count), so a subtree that is entirely visible is
+// emitted without visiting its children.
+//
+// Bodies move every step, so Update() refits the bounds in place and only
+// rebuilds the topology every rebuildInterval calls (or when the body count
+// changes), keeping the per-frame cost linear.
+//
+// Besides culling and ray picking it answers neighbor queries on the body
+// centers: k nearest, within a radius and inside a box. A sphere's box
+// contains its center, so node boxes bound center distances from below and
+// prune the same way. The queries only read the tree, so any number can run
+// at once; the *Batch variants spread them over a thread pool.
+class Bvh {
+public:
+    static constexpr uint32_t leafSize = 4;
+    static constexpr unsigned rebuildInterval = 30;
+    static constexpr uint32_t noHit = UINT32_MAX;
+
+    struct Neighbor {
+        uint32_t body;
+        float dist2; // squared distance from the query point
+    };
+
+    struct Node {
+        glm::vec3 lo;
+        uint32_t first;
+        glm::vec3 hi;
+        uint32_t count;
+        uint32_t right; // 0 for leaves
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> order; // body index of each leaf item
+
+    void Update(const glm::vec3* center, const float* radius, size_t n) {
+        ProfileScope profile("bvh");
+        if (n != order.size() || ++updates >= rebuildInterval)
+            Build(center, radius, n);
+        else
+            Refit(center, radius);
+    }
+
+    // Median split along the longest axis of the centers.
+    void Build(const glm::vec3* center, const float* radius, size_t n) {
+        updates = 0;
+        order.resize(n);
+        itemBoxes.resize(n);
+        itemCenters.resize(n);
+        for (size_t i = 0; i < n; ++i) order[i] = (uint32_t)i;
+        nodes.clear();
+        if (n > 0) BuildNode(center, radius, 0, (uint32_t)n);
+    }
+
+    // Recomputes all bounds for new positions, children before parents.
+    void Refit(const glm::vec3* center, const float* radius) {
+        for (size_t k = nodes.size(); k-- > 0;) {
+            Node& node = nodes[k];
+            if (node.right == 0) {
+                LeafBounds(node, center, radius);
+            } else {
+                const Node& a = nodes[k + 1];
+                const Node& b = nodes[node.right];
+                node.lo = glm::min(a.lo, b.lo);
+                node.hi = glm::max(a.hi, b.hi);
+            }
+        }
+    }
+
+    // Calls visible(body) for every body whose bounding sphere's box touches
+    // the frustum. Subtrees fully inside are emitted without further tests.
+    template <class Fn>
+    void Cull(const Frustum& frustum, Fn&& visible) const {
+        if (nodes.empty()) return;
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            Frustum::Result r = frustum.Classify(node.lo, node.hi);
+            if (r == Frustum::Outside) continue;
+            if (r == Frustum::Inside || node.right == 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    if (r == Frustum::Inside || node.count == 1) {
+                        visible(order[i]);
+                    } else if (frustum.Classify(itemBoxes[i].lo, itemBoxes[i].hi) != Frustum::Outside) {
+                        visible(order[i]);
+                    }
+                }
+                continue;
+            }
+            stack[top++] = node.right;
+            stack[top++] = (uint32_t)(&node - nodes.data()) + 1;
+        }
+    }
+
+    // Nearest body whose sphere is hit by the ray origin + t * dir, t >= 0,
+    // with dir normalized; noHit if there is none. The sphere arrays are the
+    // ones of the last Update(). Children are visited near box first and a
+    // box that starts beyond the best hit so far is skipped, so a ray only
+    // opens the few nodes along its path instead of testing every body.
+    uint32_t Raycast(const glm::vec3& origin, const glm::vec3& dir, const glm::vec3* center, const float* radius,
+                     float* hitT = nullptr) const {
+        uint32_t hit = noHit;
+        float best = INFINITY;
+        glm::vec3 inv = 1.0f / dir;
+        struct Entry {
+            uint32_t node;
+            float t;
+        };
+        Entry stack[64];
+        int top = 0;
+        if (!nodes.empty()) {
+            float t = BoxEntry(nodes[0], origin, inv);
+            if (t < best) stack[top++] = { 0, t };
+        }
+        while (top > 0) {
+            Entry e = stack[--top];
+            if (e.t >= best) continue;
+            const Node& node = nodes[e.node];
+            if (node.right == 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    uint32_t b = order[i];
+                    glm::vec3 oc = origin - center[b];
+                    float half = glm::dot(oc, dir), c = glm::dot(oc, oc) - radius[b] * radius[b];
+                    float disc = half * half - c;
+                    if (disc < 0.0f) continue;
+                    float root = std::sqrt(disc), t = -half - root;
+                    if (t < 0.0f) t = -half + root; // origin inside the sphere
+                    if (t >= 0.0f && t < best) {
+                        best = t;
+                        hit = b;
+                    }
+                }
+                continue;
+            }
+            Entry closer = { e.node + 1, BoxEntry(nodes[e.node + 1], origin, inv) };
+            Entry farther = { node.right, BoxEntry(nodes[node.right], origin, inv) };
+            if (farther.t < closer.t) std::swap(closer, farther);
+            if (farther.t < best) stack[top++] = farther;
+            if (closer.t < best) stack[top++] = closer;
+        }
+        if (hitT) *hitT = best;
+        return hit;
+    }
+
+    // The up to k bodies nearest to point, closest first, written to out
+    // (k entries); returns how many were found. A query at a body's own
+    // center finds that body first, so ask for one more to skip it.
+    size_t Nearest(const glm::vec3& point, size_t k, Neighbor* out) const {
+        size_t found = 0;
+        if (k == 0 || nodes.empty()) return 0;
+        auto farthest = [](const Neighbor& a, const Neighbor& b) { return a.dist2 < b.dist2; };
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            float limit = found == k ? out[0].dist2 : INFINITY; // out is a max-heap until sorted
+            if (BoxDistance2(node.lo, node.hi, point) >= limit) continue;
+            if (node.right == 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    glm::vec3 d = itemCenters[i] - point;
+                    float dist2 = glm::dot(d, d);
+                    if (found < k) {
+                        out[found++] = { order[i], dist2 };
+                        std::push_heap(out, out + found, farthest);
+                    } else if (dist2 < out[0].dist2) {
+                        std::pop_heap(out, out + k, farthest);
+                        out[k - 1] = { order[i], dist2 };
+                        std::push_heap(out, out + k, farthest);
+                    }
+                }
+                continue;
+            }
+            uint32_t index = (uint32_t)(&node - nodes.data());
+            uint32_t closer = index + 1, farther = node.right;
+            if (BoxDistance2(nodes[farther].lo, nodes[farther].hi, point) <
+                BoxDistance2(nodes[closer].lo, nodes[closer].hi, point))
+                std::swap(closer, farther);
+            stack[top++] = farther;
+            stack[top++] = closer;
+        }
+        std::sort_heap(out, out + found, farthest);
+        return found;
+    }
+
+    // Calls fn(body, dist2) for every body whose center is within radius of
+    // point.
+    template <class Fn>
+    void ForEachWithin(const glm::vec3& point, float radius, Fn&& fn) const {
+        if (nodes.empty()) return;
+        float r2 = radius * radius;
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (BoxDistance2(node.lo, node.hi, point) > r2) continue;
+            if (node.right == 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    glm::vec3 d = itemCenters[i] - point;
+                    float dist2 = glm::dot(d, d);
+                    if (dist2 <= r2) fn(order[i], dist2);
+                }
+                continue;
+            }
+            stack[top++] = node.right;
+            stack[top++] = (uint32_t)(&node - nodes.data()) + 1;
+        }
+    }
+
+    // Calls fn(body) for every body whose center lies in the box [lo, hi].
+    template <class Fn>
+    void ForEachInBox(const glm::vec3& lo, const glm::vec3& hi, Fn&& fn) const {
+        if (nodes.empty()) return;
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = nodes[stack[--top]];
+            if (glm::any(glm::greaterThan(node.lo, hi)) || glm::any(glm::lessThan(node.hi, lo))) continue;
+            if (node.right == 0) {
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    const glm::vec3& c = itemCenters[i];
+                    if (glm::all(glm::greaterThanEqual(c, lo)) && glm::all(glm::lessThanEqual(c, hi))) fn(order[i]);
+                }
+                continue;
+            }
+            stack[top++] = node.right;
+            stack[top++] = (uint32_t)(&node - nodes.data()) + 1;
+        }
+    }
+
+    // Nearest() for count points: out holds k entries per point and found[q]
+    // the number filled for point q.
+    void NearestBatch(ThreadPool& pool, const glm::vec3* points, size_t count, size_t k, Neighbor* out,
+                      uint32_t* found) const {
+        size_t blocks = (count + queryBlock - 1) / queryBlock;
+        pool.Run(blocks, [&](size_t b, unsigned) {
+            size_t end = std::min((b + 1) * queryBlock, count);
+            for (size_t q = b * queryBlock; q < end; ++q) found[q] = (uint32_t)Nearest(points[q], k, out + q * k);
+        });
+    }
+
+    // Calls fn(query, body, dist2, worker) for every body within radius of
+    // each of the count points. Calls for different queries run
+    // concurrently; worker is in [0, pool.Size()) for per-thread output.
+    template <class Fn>
+    void ForEachWithinBatch(ThreadPool& pool, const glm::vec3* points, size_t count, float radius, Fn&& fn) const {
+        size_t blocks = (count + queryBlock - 1) / queryBlock;
+        pool.Run(blocks, [&](size_t b, unsigned worker) {
+            size_t end = std::min((b + 1) * queryBlock, count);
+            for (size_t q = b * queryBlock; q < end; ++q)
+                ForEachWithin(points[q], radius, [&](uint32_t body, float dist2) { fn(q, body, dist2, worker); });
+        });
+    }
+
+    // Every pair of bodies whose centers are closer than distance, each pair
+    // once as (lower id, higher id), for close-encounter detection. Workers
+    // collect pairs on their own scratch arenas.
+    void CloseEncounters(ThreadPool& pool, float distance, std::vector<std::pair<uint32_t, uint32_t>>& pairs) {
+        using PairList = ArenaVector<std::pair<uint32_t, uint32_t>>;
+        ArenaScope scope(pool.Scratch(0));
+        ArenaVector<PairList> lists(ArenaAllocator<PairList>(pool.Scratch(0)));
+        lists.reserve(pool.Size());
+        ArenaVector<Arena::Mark> marks(ArenaAllocator<Arena::Mark>(pool.Scratch(0)));
+        marks.reserve(pool.Size());
+        for (unsigned w = 0; w < pool.Size(); ++w) {
+            marks.push_back(pool.Scratch(w).GetMark());
+            lists.emplace_back(PairList::allocator_type(pool.Scratch(w)));
+        }
+        size_t n = itemCenters.size();
+        size_t blocks = (n + queryBlock - 1) / queryBlock;
+        pool.Run(blocks, [&](size_t b, unsigned worker) {
+            size_t end = std::min((b + 1) * queryBlock, n);
+            for (size_t i = b * queryBlock; i < end; ++i) {
+                uint32_t self = order[i];
+                ForEachWithin(itemCenters[i], distance, [&](uint32_t body, float dist2) {
+                    if (body > self && dist2 < distance * distance) lists[worker].emplace_back(self, body);
+                });
+            }
+        });
+        pairs.clear();
+        for (const auto& list : lists) pairs.insert(pairs.end(), list.begin(), list.end());
+        for (unsigned w = 1; w < pool.Size(); ++w) pool.Scratch(w).Rewind(marks[w]);
+    }
+
+private:
+    static constexpr size_t queryBlock = 256; // queries per pool task
+
+    // Squared distance from point to the box, 0 inside.
+    static float BoxDistance2(const glm::vec3& lo, const glm::vec3& hi, const glm::vec3& point) {
+        glm::vec3 d = glm::max(glm::max(lo - point, point - hi), glm::vec3(0.0f));
+        return glm::dot(d, d);
+    }
+
+    // Distance along the ray to where it enters the node's box, clamped to
+    // 0 when the origin is inside; INFINITY when it misses.
+    // Where the ray enters the box (0 if it starts inside), INFINITY if it
+    // misses. An axis the ray runs parallel to has an infinite inverse; if
+    // the origin lies on one of that axis's faces, 0 * inf makes its slab
+    // NaN. The ray then stays in the face plane, which counts as inside, so
+    // that axis sets no limit.
+    static float BoxEntry(const Node& node, const glm::vec3& origin, const glm::vec3& inv) {
+        float enter = 0.0f, exit = INFINITY;
+        for (int k = 0; k < 3; ++k) {
+            float t1 = (node.lo[k] - origin[k]) * inv[k], t2 = (node.hi[k] - origin[k]) * inv[k];
+            if (std::isnan(t1) || std::isnan(t2)) continue;
+            enter = std::max(enter, std::min(t1, t2));
+            exit = std::min(exit, std::max(t1, t2));
+        }
+        return enter <= exit ? enter : INFINITY;
+    }
+
+    uint32_t BuildNode(const glm::vec3* center, const float* radius, uint32_t first, uint32_t count) {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back({ glm::vec3(0.0f), first, glm::vec3(0.0f), count, 0 });
+        if (count <= leafSize) {
+            LeafBounds(nodes[index], center, radius);
+            return index;
+        }
+
+        glm::vec3 lo = center[order[first]], hi = lo;
+        for (uint32_t i = first + 1; i < first + count; ++i) {
+            lo = glm::min(lo, center[order[i]]);
+            hi = glm::max(hi, center[order[i]]);
+        }
+        glm::vec3 extent = hi - lo;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        uint32_t half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                         [&](uint32_t a, uint32_t b) { return center[a][axis] < center[b][axis]; });
+
+        BuildNode(center, radius, first, half);
+        uint32_t right = BuildNode(center, radius, first + half, count - half);
+        Node& node = nodes[index];
+        node.right = right;
+        node.lo = glm::min(nodes[index + 1].lo, nodes[right].lo);
+        node.hi = glm::max(nodes[index + 1].hi, nodes[right].hi);
+        return index;
+    }
+
+    void LeafBounds(Node& node, const glm::vec3* center, const float* radius) {
+        node.lo = glm::vec3(INFINITY);
+        node.hi = glm::vec3(-INFINITY);
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            uint32_t b = order[i];
+            itemBoxes[i] = { center[b] - radius[b], center[b] + radius[b] };
+            itemCenters[i] = center[b];
+            node.lo = glm::min(node.lo, itemBoxes[i].lo);
+            node.hi = glm::max(node.hi, itemBoxes[i].hi);
+        }
+    }
+
+    struct Box {
+        glm::vec3 lo, hi;
+    };
+
+    std::vector<Box> itemBoxes;        // per leaf item, in order[] order
+    std::vector<glm::vec3> itemCenters; // likewise
+    unsigned updates = 0;
+};
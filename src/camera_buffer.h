@@ -0,0 +1,52 @@
+#pragma once
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// Uniform buffer binding point of the camera block.
+constexpr GLuint cameraBinding = 0;
+
+// Per-frame camera state, laid out as the std140 block `Camera` declared in
+// cameraBlockSource; every shader reads its matrices from there instead of
+// the fixed-function matrix stack.
+struct CameraUniforms {
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 viewProjection;
+    glm::vec4 viewport; // width, height, focal length in pixels, unused
+};
+
+const char* const cameraBlockSource = R"(
+layout(std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec4 viewport;
+};
+)";
+
+// The uniform buffer behind the camera block, filled once per frame.
+class CameraBuffer {
+public:
+    void Init() {
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraUniforms), nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, cameraBinding, ubo);
+    }
+
+    void Update(const CameraUniforms& camera) {
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(CameraUniforms), &camera);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // Points the program's camera block, if it uses one, at this buffer.
+    static void Attach(GLuint program) {
+        GLuint block = glGetUniformBlockIndex(program, "Camera");
+        if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, cameraBinding);
+    }
+
+private:
+    GLuint ubo = 0;
+};
@@ -0,0 +1,127 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+#include "gravity.h"
+#include "space.h"
+#include "thread_pool.h"
+
+// Systems per block, one SIMD lane each. Eight floats fill an AVX register
+// (or two SSE ones). The kernel uses GCC vector types so it vectorizes even
+// where the auto-vectorizer gives up; the lane-wise sqrt only becomes sqrtps
+// without errno handling, which is why the build uses -fno-math-errno.
+constexpr size_t ensembleLanes = 8;
+typedef float EnsembleLanes __attribute__((vector_size(ensembleLanes * sizeof(float))));
+
+// ensembleLanes independent N-body systems stored lane-major: every array is
+// indexed [axis][body][lane], so the same body of all systems sits in one
+// vector. PlaneXZ blocks have no y arrays at all. The last S bodies of each
+// system are static: they pull on the others but are never updated.
+template <size_t N, class Space = Space3D, size_t S = 0>
+struct EnsembleBlock {
+    static constexpr size_t numDynamic = N - S;
+    static constexpr size_t L = ensembleLanes;
+    static constexpr int D = Space::dims;
+
+    EnsembleLanes pos[D][N];
+    EnsembleLanes vel[D][N];
+    EnsembleLanes mass[N];
+
+    // One semi-implicit Euler step of all lanes in lock-step.
+    void Step(float dt) {
+        EnsembleLanes acc[D][N] = {};
+        for (size_t i = 0; i < numDynamic; ++i) {
+            for (size_t j = i + 1; j < numDynamic; ++j) {
+                EnsembleLanes d[D], s;
+                Pair(i, j, d, s);
+                EnsembleLanes si = s * mass[j], sj = s * mass[i];
+                for (int k = 0; k < D; ++k) {
+                    acc[k][i] += d[k] * si;
+                    acc[k][j] -= d[k] * sj;
+                }
+            }
+            for (size_t j = numDynamic; j < N; ++j) {
+                EnsembleLanes d[D], s;
+                Pair(i, j, d, s);
+                s *= mass[j];
+                for (int k = 0; k < D; ++k) acc[k][i] += d[k] * s;
+            }
+        }
+        for (int k = 0; k < D; ++k) {
+            for (size_t i = 0; i < numDynamic; ++i) {
+                vel[k][i] += acc[k][i] * dt;
+                pos[k][i] += vel[k][i] * dt;
+            }
+        }
+    }
+
+private:
+    // Separation of bodies i and j in d, and G / |d|^3 (softened) in s.
+    void Pair(size_t i, size_t j, EnsembleLanes* d, EnsembleLanes& s) const {
+        EnsembleLanes dist2 = {};
+        for (int k = 0; k < D; ++k) {
+            d[k] = pos[k][j] - pos[k][i];
+            dist2 += d[k] * d[k];
+        }
+        dist2 += softening2;
+        EnsembleLanes dist;
+        for (size_t l = 0; l < L; ++l) dist[l] = std::sqrt(dist2[l]);
+        s = gravityG / (dist2 * dist);
+    }
+};
+
+// Any number of independent N-body systems, integrated ensembleLanes at a
+// time. Unused lanes of the last block hold massless bodies at the origin.
+template <size_t N, class Space = Space3D, size_t S = 0>
+class Ensemble {
+public:
+    using Vec = typename Space::Vec;
+    static constexpr size_t L = ensembleLanes;
+    static constexpr size_t blocksPerTask = 4;
+
+    explicit Ensemble(size_t systems) : count(systems), blocks((systems + L - 1) / L) {}
+
+    size_t Size() const { return count; }
+
+    void SetBody(size_t system, size_t body, const Vec& p, const Vec& v, float m) {
+        EnsembleBlock<N, Space, S>& b = blocks[system / L];
+        size_t l = system % L;
+        for (int k = 0; k < Space::dims; ++k) {
+            b.pos[k][body][l] = p[k];
+            b.vel[k][body][l] = v[k];
+        }
+        b.mass[body][l] = m;
+    }
+
+    Vec Position(size_t system, size_t body) const {
+        const EnsembleBlock<N, Space, S>& b = blocks[system / L];
+        Vec p;
+        for (int k = 0; k < Space::dims; ++k) p[k] = b.pos[k][body][system % L];
+        return p;
+    }
+
+    Vec Velocity(size_t system, size_t body) const {
+        const EnsembleBlock<N, Space, S>& b = blocks[system / L];
+        Vec v;
+        for (int k = 0; k < Space::dims; ++k) v[k] = b.vel[k][body][system % L];
+        return v;
+    }
+
+    // Advances every system by steps * dt. A task takes a chunk of blocks
+    // through all the steps, so its state stays in cache for the whole run.
+    void Integrate(ThreadPool& pool, float dt, size_t steps) {
+        size_t tasks = (blocks.size() + blocksPerTask - 1) / blocksPerTask;
+        pool.Run(tasks, [&](size_t t, unsigned) {
+            size_t begin = t * blocksPerTask, end = std::min(begin + blocksPerTask, blocks.size());
+            for (size_t s = 0; s < steps; ++s)
+                for (size_t b = begin; b < end; ++b)
+                    blocks[b].Step(dt);
+        });
+    }
+
+private:
+    size_t count;
+    std::vector<EnsembleBlock<N, Space, S>> blocks;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "arena.h"
+#include "thread_pool.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Twiddle factors exp(-2 pi i k / n) for k < n / 2, written to w.
+inline void FftTwiddles(size_t n, std::complex<float>* w) {
+    for (size_t k = 0; k < n / 2; ++k) {
+        double angle = -2.0 * M_PI * (double)k / (double)n;
+        w[k] = std::complex<float>((float)std::cos(angle), (float)std::sin(angle));
+    }
+}
+
+// In-place iterative radix-2 FFT of n contiguous values; n must be a power
+// of two and twiddle come from FftTwiddles(n). The inverse is unscaled, so
+// a forward/inverse round trip multiplies by n. Products are written out by
+// hand because std::complex multiplication checks every result for NaN.
+inline void Fft(std::complex<float>* a, size_t n, const std::complex<float>* twiddle, bool inverse) {
+    for (size_t i = 1, j = 0; i < n; ++i) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(a[i], a[j]);
+    }
+    float sign = inverse ? -1.0f : 1.0f;
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t half = len / 2, step = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t k = 0; k < half; ++k) {
+                float wr = twiddle[k * step].real(), wi = sign * twiddle[k * step].imag();
+                std::complex<float>& even = a[i + k];
+                std::complex<float>& odd = a[i + k + half];
+                std::complex<float> t(odd.real() * wr - odd.imag() * wi, odd.real() * wi + odd.imag() * wr);
+                odd = even - t;
+                even += t;
+            }
+        }
+    }
+}
+
+// Transposes an n x n row-major grid in place.
+inline void Transpose(std::complex<float>* a, size_t n) {
+    for (size_t r = 0; r < n; ++r)
+        for (size_t c = r + 1; c < n; ++c)
+            std::swap(a[r * n + c], a[c * n + r]);
+}
+
+// 2D FFT of an n x n row-major grid. Columns are done as rows of the
+// transpose, which keeps every 1D transform contiguous; each pass of rows is
+// spread over the pool.
+inline void Fft2D(ThreadPool& pool, std::complex<float>* a, size_t n, bool inverse) {
+    ArenaScope scope(pool.Scratch(0));
+    ArenaVector<std::complex<float>> twiddle(n / 2, ArenaAllocator<std::complex<float>>(pool.Scratch(0)));
+    FftTwiddles(n, twiddle.data());
+    for (int pass = 0; pass < 2; ++pass) {
+        pool.Run(n, [&](size_t r, unsigned) { Fft(a + r * n, n, twiddle.data(), inverse); });
+        Transpose(a, n);
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <glm/glm.hpp>
+#include "gravity.h"
+#include "space.h"
+
+// Largest body count that gets a compile-time specialized kernel in each
+// Space. Every size up to it is instantiated, and each instantiation
+// expands its whole pair list, so compile time grows with the cube of the
+// cap (about 3.5 minutes for main.cpp at 32). `gravity_sim --bench-forces`
+// times both kernels on small systems: in the plane the unrolled one is
+// about 1.2-1.3x faster than GravitySolver for N = 8..12, which covers the
+// default scene; in 3D it is about even up to N = 9 and slower from 12 on.
+// Past the caps the expanded code no longer fits and it falls well behind.
+template <class Space>
+constexpr size_t fixedSystemMax = Space::dims == 2 ? 12 : 9;
+
+// The N*(N-1)/2 pairs (i, j), i < j, of an N-body system in the order the
+// generic pair loop visits them: by i, then by j.
+template <size_t N>
+struct FixedPairs {
+    static constexpr size_t count = N * (N - 1) / 2;
+    std::array<size_t, count + 1> i{}, j{}; // + 1 keeps N < 2 well-formed
+
+    constexpr FixedPairs() {
+        size_t p = 0;
+        for (size_t a = 0; a < N; ++a) {
+            for (size_t b = a + 1; b < N; ++b) {
+                i[p] = a;
+                j[p] = b;
+                ++p;
+            }
+        }
+    }
+};
+
+// N-body system whose size is known at compile time. Everything lives in
+// std::arrays and the pair list is a constant table expanded into straight-
+// line code, one block per pair with constant indices, so there is no loop
+// or heap overhead per system. Meant for small systems (the solar system in
+// main() is N = 9) integrated in large numbers.
+template <size_t N, class Space = Space3D>
+struct FixedSystem {
+    using Vec = typename Space::Vec;
+    static constexpr FixedPairs<N> pairs{};
+
+    std::array<Vec, N> position;
+    std::array<Vec, N> velocity;
+    std::array<float, N> mass;
+
+    // Gravitational acceleration of every body, each pair evaluated once,
+    // plus the pull of numSources bodies that only act as sources.
+    std::array<Vec, N> Accelerations(const Vec* srcPos = nullptr, const float* srcMass = nullptr,
+                                     size_t numSources = 0) const {
+        std::array<Vec, N> acc;
+        for (size_t i = 0; i < N; ++i) acc[i] = Vec(0.0f);
+        if constexpr (N > 1) AddPairs(acc, std::make_index_sequence<FixedPairs<N>::count>{});
+        if constexpr (N > 0) {
+            for (size_t k = 0; k < numSources; ++k)
+                AddSource(acc, srcPos[k], srcMass[k], std::make_index_sequence<N>{});
+        }
+        return acc;
+    }
+
+    // Semi-implicit Euler (kick, then drift), as in BodyStore::Integrate.
+    void Step(float dt, const Vec* srcPos = nullptr, const float* srcMass = nullptr, size_t numSources = 0) {
+        std::array<Vec, N> acc = Accelerations(srcPos, srcMass, numSources);
+        for (size_t i = 0; i < N; ++i) {
+            velocity[i] += acc[i] * dt;
+            position[i] += velocity[i] * dt;
+        }
+    }
+
+private:
+    // All pair separations first, then their scale factors, then the
+    // updates in pair order: the first two steps are independent across
+    // pairs, which keeps the sqrt and divide units busy.
+    template <size_t... P>
+    void AddPairs(std::array<Vec, N>& acc, std::index_sequence<P...>) const {
+        Vec dir[sizeof...(P) + 1];
+        float s[sizeof...(P) + 1];
+        ((dir[P] = position[pairs.j[P]] - position[pairs.i[P]]), ...);
+        auto scale = [&](size_t p) {
+            float dist2 = glm::dot(dir[p], dir[p]) + softening2;
+            s[p] = gravityG / (dist2 * std::sqrt(dist2));
+        };
+        (scale(P), ...);
+        ((acc[pairs.i[P]] += dir[P] * (s[P] * mass[pairs.j[P]]),
+          acc[pairs.j[P]] -= dir[P] * (s[P] * mass[pairs.i[P]])), ...);
+    }
+
+    template <size_t... I>
+    void AddSource(std::array<Vec, N>& acc, const Vec& src, float srcMass, std::index_sequence<I...>) const {
+        auto pull = [&](size_t i) {
+            Vec dir = src - position[i];
+            float dist2 = glm::dot(dir, dir) + softening2;
+            acc[i] += dir * (gravityG * srcMass / (dist2 * std::sqrt(dist2)));
+        };
+        (pull(I), ...);
+    }
+};
@@ -0,0 +1,239 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glad/glad.h>
+#include "image_writer.h"
+#include "memory_stats.h"
+#include "profiler.h"
+
+// Writes rendered frames to disk without stalling the render loop.
+//
+// Capture() starts an asynchronous glReadPixels into one of ringSize pixel
+// pack buffers and drops a fence behind it; the buffer is only mapped when
+// its slot comes round again, ringSize captures later, by which time the GPU
+// has normally finished the copy. If it has not, Capture() waits on that
+// oldest fence rather than dropping the frame, since a recording advances
+// the simulation by a fixed step per frame and a lost frame would show as a
+// jump in time. The mapped pixels are copied into one of
+// a fixed set of frame buffers and handed to a writer thread that encodes
+// and writes them. If the disk falls behind, Capture() blocks until a frame
+// buffer is free rather than dropping frames or allocating more.
+//
+// The output path picks the format by extension: .y4m is one video stream,
+// .png writes one file per frame and .raw one RGB24 stream. A file name
+// holding a frame number placeholder, %d or %0Nd ("frames/%05d.png"),
+// writes numbered files; .png gets "_00000" style numbers before the
+// extension when it has none. Only the number is ever formatted, so any
+// other % in the path is taken literally.
+class FrameRecorder {
+public:
+    static constexpr int ringSize = 3;
+    static constexpr size_t frameBuffers = 6;
+
+    ~FrameRecorder() { Close(); }
+
+    bool Open(const std::string& path, int w, int h, int framesPerSecond) {
+        width = w;
+        height = h;
+        fps = framesPerSecond;
+        format = ImageFormatFromPath(path);
+        bool numbered = SplitNumberPlaceholder(path);
+        if (format == ImageFormat::Y4m || (format == ImageFormat::Raw && !numbered)) {
+            stream = fopen(path.c_str(), "wb");
+            if (!stream) {
+                std::cerr << "Cannot open " << path << " for writing\n";
+                return false;
+            }
+            if (format == ImageFormat::Y4m) {
+                std::string header = Y4mHeader(width, height, fps);
+                fwrite(header.data(), 1, header.size(), stream);
+            }
+        } else if (!numbered) {
+            size_t dot = path.find_last_of('.');
+            prefix = path.substr(0, dot) + "_";
+            suffix = path.substr(dot);
+            digits = 5;
+        }
+
+        size_t bytes = (size_t)width * height * 4;
+        glGenBuffers(ringSize, pbo);
+        for (GLuint buffer : pbo) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        frames.assign(frameBuffers, std::vector<uint8_t>(bytes));
+        for (size_t i = 0; i < frameBuffers; ++i) freeFrames.push_back(i);
+        queue.resize(frameBuffers);
+        writer = std::thread([this] { WriterLoop(); });
+        open = true;
+        return true;
+    }
+
+    // Queues a readback of the bound read framebuffer, and hands the frame
+    // captured ringSize captures ago to the writer, waiting for its copy to
+    // finish if it is still running.
+    void Capture() {
+        ProfileScope profile("capture");
+        int slot = (int)(captured % ringSize);
+        if (fence[slot]) Collect(slot);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+        {
+            DriverCallScope driver;
+            glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        ++captured;
+    }
+
+    // Collects the readbacks still in flight, waits for the writer to drain
+    // and closes the output.
+    void Close() {
+        if (!open) return;
+        for (int k = 0; k < ringSize; ++k) {
+            int slot = (int)((captured + k) % ringSize);
+            if (fence[slot]) Collect(slot);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        wake.notify_all();
+        writer.join();
+        if (stream) fclose(stream);
+        stream = nullptr;
+        glDeleteBuffers(ringSize, pbo);
+        open = false;
+        std::cout << "Recorded " << written << " frames\n";
+    }
+
+private:
+    struct Job {
+        size_t frame;  // index into frames
+        size_t number; // position in the recording
+    };
+
+    // Finds a "%d" or "%0Nd" in the file name part of path and keeps what
+    // surrounds it.
+    bool SplitNumberPlaceholder(const std::string& path) {
+        size_t name = path.find_last_of("/\\");
+        name = name == std::string::npos ? 0 : name + 1;
+        for (size_t at = path.find('%', name); at != std::string::npos; at = path.find('%', at + 1)) {
+            size_t end = at + 1;
+            while (end < path.size() && isdigit((unsigned char)path[end])) ++end;
+            if (end == path.size() || path[end] != 'd') continue;
+            prefix = path.substr(0, at);
+            suffix = path.substr(end + 1);
+            digits = std::min(atoi(path.c_str() + at + 1), 20);
+            return true;
+        }
+        return false;
+    }
+
+    // Hands the frame in slot to the writer, waiting for its copy to finish.
+    void Collect(int slot) {
+        {
+            DriverCallScope driver;
+            glClientWaitSync(fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(fence[slot]);
+        fence[slot] = nullptr;
+
+        size_t frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return !freeFrames.empty(); });
+            frame = freeFrames.back();
+            freeFrames.pop_back();
+        }
+        std::vector<uint8_t>& pixels = frames[frame];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[slot]);
+        const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pixels.size(), GL_MAP_READ_BIT);
+        if (mapped) memcpy(pixels.data(), mapped, pixels.size());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue[(queueHead + queued++) % frameBuffers] = { frame, collected++ };
+        }
+        wake.notify_one();
+    }
+
+    void WriterLoop() {
+        MemoryPhaseScope phase(MemoryPhase::Background);
+        if (Profiler::Get().Enabled()) Profiler::Get().NameThread("frame writer");
+        std::vector<uint8_t> scratch, encoded;
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return closing || queued > 0; });
+                if (queued == 0) return;
+                job = queue[queueHead];
+                queueHead = (queueHead + 1) % frameBuffers;
+                --queued;
+            }
+            {
+                ProfileScope profile("encode");
+                const uint8_t* pixels = frames[job.frame].data();
+                if (format == ImageFormat::Png) EncodePng(pixels, width, height, scratch, encoded);
+                else if (format == ImageFormat::Y4m) EncodeY4mFrame(pixels, width, height, encoded);
+                else EncodeRaw(pixels, width, height, encoded);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                freeFrames.push_back(job.frame);
+            }
+            done.notify_one();
+            Write(job.number, encoded);
+        }
+    }
+
+    void Write(size_t number, const std::vector<uint8_t>& bytes) {
+        ProfileScope profile("write");
+        FILE* file = stream;
+        if (!file) {
+            char digitsText[32];
+            snprintf(digitsText, sizeof(digitsText), "%0*d", digits, (int)number);
+            std::string name = prefix + digitsText + suffix;
+            file = fopen(name.c_str(), "wb");
+            if (!file) {
+                std::cerr << "Cannot open " << name << " for writing\n";
+                return;
+            }
+        }
+        if (fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size()) ++written;
+        if (file != stream) fclose(file);
+    }
+
+    int width = 0, height = 0, fps = 0;
+    ImageFormat format = ImageFormat::Raw;
+    std::string prefix, suffix; // around the frame number of numbered files
+    int digits = 0;
+    FILE* stream = nullptr;
+    bool open = false;
+
+    GLuint pbo[ringSize] = {};
+    GLsync fence[ringSize] = {};
+    size_t captured = 0, collected = 0, written = 0;
+
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<size_t> freeFrames;
+    std::vector<Job> queue; // ring of frameBuffers, enough for every frame in flight
+    size_t queueHead = 0, queued = 0;
+    bool closing = false;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::thread writer;
+};
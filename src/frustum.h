@@ -0,0 +1,38 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// The six clip planes of a camera, in world space when built from
+// projection * view. A point p is inside a plane when
+// dot(plane.xyz, p) + plane.w >= 0.
+struct Frustum {
+    enum Result { Outside, Intersects, Inside };
+
+    glm::vec4 planes[6];
+
+    // Gribb/Hartmann extraction: each plane is row 3 of the matrix plus or
+    // minus one of the other rows.
+    static Frustum FromMatrix(const glm::mat4& m) {
+        glm::vec4 row[4];
+        for (int r = 0; r < 4; ++r) row[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        Frustum f;
+        for (int k = 0; k < 3; ++k) {
+            f.planes[2 * k] = row[3] + row[k];
+            f.planes[2 * k + 1] = row[3] - row[k];
+        }
+        for (glm::vec4& p : f.planes) p /= glm::length(glm::vec3(p));
+        return f;
+    }
+
+    // Conservative box test: may report Intersects for a box that is just
+    // outside near a frustum corner, never Outside for a visible one.
+    Result Classify(const glm::vec3& lo, const glm::vec3& hi) const {
+        Result result = Inside;
+        for (const glm::vec4& p : planes) {
+            glm::vec3 far(p.x >= 0 ? hi.x : lo.x, p.y >= 0 ? hi.y : lo.y, p.z >= 0 ? hi.z : lo.z);
+            glm::vec3 near(p.x >= 0 ? lo.x : hi.x, p.y >= 0 ? lo.y : hi.y, p.z >= 0 ? lo.z : hi.z);
+            if (glm::dot(glm::vec3(p), far) + p.w < 0) return Outside;
+            if (glm::dot(glm::vec3(p), near) + p.w < 0) result = Intersects;
+        }
+        return result;
+    }
+};
@@ -0,0 +1,420 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <complex>
+#include <cstdint>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "arena.h"
+#include "fft.h"
+#include "mass_quadtree.h"
+#include "memory_stats.h"
+#include "profiler.h"
+#include "thread_pool.h"
+
+// Shape of the gravity well drawn under the bodies: every body lowers the
+// surface at horizontal distance d by min(mass * funnelScale / (d^2 + 1),
+// funnelDepthMax).
+constexpr float funnelScale = 0.03f;
+constexpr float funnelDepthMax = 50.0f;
+
+// Vertex offsets (in cells, per axis) the Fft mode sums exactly.
+constexpr int funnelNearCells = 2;
+
+// Rows of vertices per tile in incremental updates; a tile is one lane
+// group wide.
+constexpr int funnelTileRows = 8;
+
+// Grid points evaluated together; one AVX register of floats.
+constexpr size_t funnelLanes = 8;
+typedef float FunnelLanes __attribute__((vector_size(funnelLanes * sizeof(float))));
+
+// How vertex heights are evaluated.
+enum class FunnelMode {
+    Direct, // every body at every vertex, O(G * N)
+    Tree,   // Barnes-Hut over a MassQuadtree, O(G log N)
+    Fft     // grid-deposited masses convolved with the kernel, O(G log G + N)
+};
+
+// The funnel as a heightfield over a square grid of vertices spaced `step`
+// apart from -size to at least +size in x and z. Each vertex height is
+// computed once per update into a flat row-major array, rows spread over
+// the thread pool and funnelLanes vertices of a row per SIMD operation, then
+// uploaded into a vertex buffer drawn as one indexed triangle mesh.
+//
+// In Tree mode a quadtree node whose edge length is below theta times its
+// distance to a vertex group is taken as a single mass at its center of
+// mass. The depth clamp only bites within sqrt(mass * funnelScale /
+// funnelDepthMax) of a body, far inside any node that passes the test, so
+// the approximation error is that of the monopole alone.
+//
+// In Fft mode the clamp makes the funnel nonlinear in mass, so only bodies
+// it can never touch (mass * funnelScale <= funnelDepthMax) inside the grid
+// are deposited onto the vertices (bilinear, cloud-in-cell) and convolved
+// with the unclamped kernel through a zero-padded FFT whose transform is
+// computed once. The kernel is far narrower than a cell, so as in P3M the
+// mesh only carries the part beyond funnelNearCells cells and the vertices
+// around each light body get the exact near-field value instead. Heavy
+// bodies and bodies off the grid are added exactly as in Direct mode.
+//
+// Updates are incremental in Direct and Tree mode. Each body remembers where
+// the surface last saw it; once it has moved more than moveTolerance (or
+// its mass changed) the tiles within its influence radius around the old and
+// the new position are recomputed, where the radius is the distance beyond
+// which the body lowers the surface by less than heightEpsilon. Tiles
+// outside it can be off by that much per moved body. Frames in which no body
+// moved enough, like camera-only ones, do no surface work and upload
+// nothing; otherwise only the dirty column span of each dirty row is
+// uploaded. Fft mode skips the same frames, but once any body has moved
+// enough it recomputes and uploads the whole grid.
+class FunnelSurface {
+public:
+    FunnelMode mode = FunnelMode::Direct;
+    float theta = 0.5f;
+    bool incremental = true;
+    float moveTolerance = 0.5f;
+    float heightEpsilon = 0.01f;
+
+    FunnelSurface(float size, float step) : size(size), step(step) {
+        cells = (int)std::ceil(2.0f * size / step);
+        verts = cells + 1;
+        groups = (verts + funnelLanes - 1) / funnelLanes;
+        height.assign(verts * groups, FunnelLanes{});
+        xs.resize(groups);
+        for (size_t i = 0; i < groups * funnelLanes; ++i)
+            xs[i / funnelLanes][i % funnelLanes] = -size + (float)i * step;
+        tileRows = (verts + funnelTileRows - 1) / funnelTileRows;
+        tileDirty.assign(tileRows * groups, 0);
+        rowLo.assign(verts, verts);
+        rowHi.assign(verts, 0);
+    }
+
+    int Vertices() const { return verts; }
+    float Coord(int i) const { return xs[i / funnelLanes][i % funnelLanes]; }
+    float Height(int row, int col) const { return height[row * groups + col / funnelLanes][col % funnelLanes]; }
+
+    // Brings the vertices up to date with the bodies' x/z positions and
+    // masses.
+    void Compute(ThreadPool& pool, const glm::vec3* pos, const float* mass, size_t n) {
+        ProfileScope profile("funnel");
+        bool full = !computed || !incremental || n != seenX.size();
+        computed = true;
+        if (!full && mode == FunnelMode::Fft) {
+            size_t b = 0;
+            while (b < n && !Moved(b, pos, mass)) ++b;
+            if (b == n) return;
+            full = true;
+        }
+        if (full) {
+            seenX.resize(n);
+            seenZ.resize(n);
+            seenK.resize(n);
+            std::fill(tileDirty.begin(), tileDirty.end(), 1);
+        }
+        for (size_t b = 0; b < n; ++b) {
+            float k = mass[b] * funnelScale;
+            if (full || Moved(b, pos, mass)) {
+                if (!full) MarkTiles(seenX[b], seenZ[b], seenK[b]);
+                seenX[b] = pos[b].x;
+                seenZ[b] = pos[b].z;
+                seenK[b] = k;
+                if (!full) MarkTiles(seenX[b], seenZ[b], k);
+            }
+        }
+
+        dirtyTiles.clear();
+        for (size_t t = 0; t < tileDirty.size(); ++t) {
+            if (!tileDirty[t]) continue;
+            tileDirty[t] = 0;
+            dirtyTiles.push_back((uint32_t)t);
+            int r0 = (int)(t / groups) * funnelTileRows, r1 = std::min(r0 + funnelTileRows, verts);
+            int c0 = (int)(t % groups * funnelLanes), c1 = std::min(c0 + (int)funnelLanes, verts);
+            for (int r = r0; r < r1; ++r) {
+                rowLo[r] = std::min(rowLo[r], c0);
+                rowHi[r] = std::max(rowHi[r], c1);
+            }
+        }
+        if (dirtyTiles.empty()) return;
+
+        // Bodies as the surface sees them
+        bx = seenX;
+        bz = seenZ;
+        bk = seenK;
+        if (mode == FunnelMode::Fft) {
+            ComputeFft(pool, pos, mass, n);
+            return;
+        }
+        if (mode == FunnelMode::Tree) tree.Build(bx.data(), bz.data(), bk.data(), n);
+        pool.Run(dirtyTiles.size(), [&](size_t i, unsigned) {
+            size_t t = dirtyTiles[i], g = t % groups;
+            int r0 = (int)(t / groups) * funnelTileRows, r1 = std::min(r0 + funnelTileRows, verts);
+            for (int r = r0; r < r1; ++r) {
+                if (mode == FunnelMode::Tree)
+                    ComputeRowTree(r, g, g + 1);
+                else
+                    ComputeRow(r, g, g + 1);
+            }
+        });
+    }
+
+    // Uploads the changed part of each row and draws the surface in
+    // wireframe with whatever program is bound; vertices are at attribute
+    // location 0.
+    void Draw() {
+        if (!vbo) CreateBuffers();
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        for (int r = 0; r < verts; ++r) {
+            if (rowLo[r] >= rowHi[r]) continue;
+            rowScratch.clear();
+            for (int c = rowLo[r]; c < rowHi[r]; ++c) rowScratch.push_back(glm::vec3(Coord(c), Height(r, c), Coord(r)));
+            glBufferSubData(GL_ARRAY_BUFFER, (r * verts + rowLo[r]) * sizeof(glm::vec3),
+                            rowScratch.size() * sizeof(glm::vec3), rowScratch.data());
+            rowLo[r] = verts;
+            rowHi[r] = 0;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(vao);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        {
+            DriverCallScope driver;
+            glDrawElements(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, nullptr);
+        }
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glBindVertexArray(0);
+    }
+
+private:
+    // Whether body b has moved more than moveTolerance or changed mass since
+    // the surface last saw it.
+    bool Moved(size_t b, const glm::vec3* pos, const float* mass) const {
+        float dx = pos[b].x - seenX[b], dz = pos[b].z - seenZ[b];
+        return dx * dx + dz * dz > moveTolerance * moveTolerance || mass[b] * funnelScale != seenK[b];
+    }
+
+    // Marks the tiles a body at (x, z) lowers by heightEpsilon or more. The
+    // depth clamp only flattens the bottom of the well, so the reach comes
+    // from the unclamped kernel; it is capped where the box around the body
+    // already covers the whole grid.
+    void MarkTiles(float x, float z, float k) {
+        float reach = std::sqrt(std::max(k / heightEpsilon - 1.0f, 0.0f));
+        reach = std::min(reach, std::max(std::abs(x), std::abs(z)) + size + step);
+        int c0 = std::max((int)std::floor((x - reach + size) / step), 0);
+        int c1 = std::min((int)std::ceil((x + reach + size) / step), verts - 1);
+        int r0 = std::max((int)std::floor((z - reach + size) / step), 0);
+        int r1 = std::min((int)std::ceil((z + reach + size) / step), verts - 1);
+        if (c0 > c1 || r0 > r1) return;
+        for (int tr = r0 / funnelTileRows; tr <= r1 / funnelTileRows; ++tr)
+            for (int tc = c0 / (int)funnelLanes; tc <= c1 / (int)funnelLanes; ++tc)
+                tileDirty[tr * groups + tc] = 1;
+    }
+
+    // Lane groups [gBegin, gEnd) of one row, body by body so the inner loop
+    // runs over contiguous heights; padding lanes past the last vertex are
+    // discarded.
+    void ComputeRow(int row, size_t gBegin, size_t gEnd) {
+        FunnelLanes* h = &height[row * groups];
+        const FunnelLanes* x = xs.data();
+        float z = Coord(row);
+        for (size_t g = gBegin; g < gEnd; ++g) h[g] = FunnelLanes{};
+        for (size_t b = 0; b < bx.size(); ++b) {
+            float dz = z - bz[b];
+            float dz2 = dz * dz + 1.0f;
+            for (size_t g = gBegin; g < gEnd; ++g) {
+                FunnelLanes dx = x[g] - bx[b];
+                FunnelLanes depth = bk[b] / (dx * dx + dz2);
+                h[g] -= depth < funnelDepthMax ? depth : funnelDepthMax;
+            }
+        }
+    }
+
+    void ComputeFft(ThreadPool& pool, const glm::vec3* pos, const float* mass, size_t n) {
+        if (kernel.empty()) BuildKernel(pool);
+
+        // Split bodies into deposited and direct ones; bx/bz/bk keep the
+        // latter, light bodies are bucketed by the grid row they fall in.
+        ArenaScope scope(pool.Scratch(0));
+        ArenaAllocator<LightBody> alloc(pool.Scratch(0));
+        ArenaVector<LightBody> light(alloc), sortedLight(alloc); // sorted by row
+        ArenaVector<size_t> lightStart(verts + 1, 0, alloc), lightFill(alloc);
+        light.reserve(n);
+        size_t direct = 0;
+        for (size_t b = 0; b < n; ++b) {
+            float u = (pos[b].x + size) / step, v = (pos[b].z + size) / step;
+            int c = (int)std::floor(u), r = (int)std::floor(v);
+            if (mass[b] * funnelScale > funnelDepthMax || c < 0 || r < 0 || c + 1 >= verts || r + 1 >= verts) {
+                bx[direct] = pos[b].x;
+                bz[direct] = pos[b].z;
+                bk[direct] = mass[b] * funnelScale;
+                ++direct;
+                continue;
+            }
+            light.push_back({ pos[b].x, pos[b].z, mass[b], r, c, u - c, v - r });
+            ++lightStart[r + 1];
+        }
+        bx.resize(direct);
+        bz.resize(direct);
+        bk.resize(direct);
+        for (int r = 0; r < verts; ++r) lightStart[r + 1] += lightStart[r];
+        sortedLight.resize(light.size());
+        lightFill.assign(lightStart.begin(), lightStart.end() - 1);
+        for (const LightBody& l : light) sortedLight[lightFill[l.row]++] = l;
+
+        std::fill(grid.begin(), grid.end(), std::complex<float>(0.0f));
+        for (const LightBody& l : sortedLight) {
+            size_t at = l.row * fftSize + l.col;
+            grid[at] += l.mass * (1 - l.fu) * (1 - l.fv);
+            grid[at + 1] += l.mass * l.fu * (1 - l.fv);
+            grid[at + fftSize] += l.mass * (1 - l.fu) * l.fv;
+            grid[at + fftSize + 1] += l.mass * l.fu * l.fv;
+        }
+        Fft2D(pool, grid.data(), fftSize, false);
+        for (size_t i = 0; i < grid.size(); ++i) grid[i] = ComplexMul(grid[i], kernel[i]);
+        Fft2D(pool, grid.data(), fftSize, true);
+
+        float norm = 1.0f / (float)(fftSize * fftSize);
+        pool.Run(verts, [&](size_t row, unsigned) {
+            int r = (int)row;
+            ComputeRow(r, 0, groups);
+            FunnelLanes* h = &height[row * groups];
+            for (int c = 0; c < verts; ++c) h[c / funnelLanes][c % funnelLanes] -= grid[row * fftSize + c].real() * norm;
+
+            // Near field: replace what the mesh gave each vertex close to a
+            // light body by the exact value.
+            int rowLo = std::max(r - funnelNearCells - 1, 0), rowHi = std::min(r + funnelNearCells, verts - 1);
+            float z = Coord(r);
+            for (size_t k = lightStart[rowLo]; k < lightStart[rowHi + 1]; ++k) {
+                const LightBody& l = sortedLight[k];
+                float dz = z - l.z;
+                int cLo = std::max(l.col - funnelNearCells, 0), cHi = std::min(l.col + 1 + funnelNearCells, verts - 1);
+                for (int c = cLo; c <= cHi; ++c) {
+                    float dx = Coord(c) - l.x;
+                    float exact = l.mass * funnelScale / (dx * dx + dz * dz + 1.0f);
+                    float mesh = l.mass * ((1 - l.fu) * (1 - l.fv) * FarKernel(r - l.row, c - l.col) +
+                                           l.fu * (1 - l.fv) * FarKernel(r - l.row, c - l.col - 1) +
+                                           (1 - l.fu) * l.fv * FarKernel(r - l.row - 1, c - l.col) +
+                                           l.fu * l.fv * FarKernel(r - l.row - 1, c - l.col - 1));
+                    h[c / funnelLanes][c % funnelLanes] -= exact - mesh;
+                }
+            }
+        });
+    }
+
+    // The kernel scale / (d^2 + 1) between vertices i rows and j columns
+    // apart, without the near field that is summed exactly.
+    float FarKernel(int i, int j) const {
+        if (std::abs(i) <= funnelNearCells && std::abs(j) <= funnelNearCells) return 0.0f;
+        return funnelScale / ((float)(i * i + j * j) * step * step + 1.0f);
+    }
+
+    // std::complex multiplication checks for NaN/inf on every product,
+    // which dominates the convolution.
+    static std::complex<float> ComplexMul(std::complex<float> a, std::complex<float> b) {
+        return { a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real() };
+    }
+
+    // Transform of FarKernel for every vertex offset, wrapped around a grid
+    // at least twice the surface so the convolution does not alias.
+    void BuildKernel(ThreadPool& pool) {
+        fftSize = 1;
+        while (fftSize < 2 * (size_t)verts) fftSize <<= 1;
+        grid.assign(fftSize * fftSize, std::complex<float>(0.0f));
+        kernel.assign(fftSize * fftSize, std::complex<float>(0.0f));
+        for (int i = -(verts - 1); i < verts; ++i) {
+            for (int j = -(verts - 1); j < verts; ++j) {
+                size_t r = (i + fftSize) % fftSize, c = (j + fftSize) % fftSize;
+                kernel[r * fftSize + c] = FarKernel(i, j);
+            }
+        }
+        Fft2D(pool, kernel.data(), fftSize, false);
+    }
+
+    // Walks the tree once per lane group. The opening test uses the vertex
+    // of the group nearest to the node, so it holds for every lane.
+    void ComputeRowTree(int row, size_t gBegin, size_t gEnd) {
+        FunnelLanes* h = &height[row * groups];
+        float z = Coord(row);
+        float theta2 = theta * theta;
+        uint32_t stack[4 * MassQuadtree::maxDepth + 4];
+        for (size_t g = gBegin; g < gEnd; ++g) {
+            FunnelLanes x = xs[g], acc = {};
+            float xLo = x[0], xHi = x[funnelLanes - 1];
+            int top = 0;
+            if (!tree.nodes.empty()) stack[top++] = 0;
+            while (top > 0) {
+                const MassQuadtree::Node& node = tree.nodes[stack[--top]];
+                if (node.count == 0) continue;
+                float dz = z - node.cz;
+                float dzz = dz * dz + 1.0f;
+                float dx = std::min(std::max(node.cx, xLo), xHi) - node.cx;
+                if (node.child == 0) {
+                    for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                        float bdz = z - tree.z[i];
+                        FunnelLanes bdx = x - tree.x[i];
+                        FunnelLanes depth = tree.mass[i] / (bdx * bdx + (bdz * bdz + 1.0f));
+                        acc += depth < funnelDepthMax ? depth : funnelDepthMax;
+                    }
+                } else if (node.size * node.size < theta2 * (dx * dx + dz * dz)) {
+                    FunnelLanes ndx = x - node.cx;
+                    FunnelLanes depth = node.mass / (ndx * ndx + dzz);
+                    acc += depth < funnelDepthMax ? depth : funnelDepthMax;
+                } else {
+                    for (uint32_t c = 0; c < 4; ++c) stack[top++] = node.child + c;
+                }
+            }
+            h[g] = -acc;
+        }
+    }
+
+    // Two triangles per cell, split along the same diagonal as the original
+    // immediate-mode funnel.
+    void CreateBuffers() {
+        std::vector<GLuint> indices;
+        indices.reserve(cells * cells * 6);
+        for (int r = 0; r < cells; ++r) {
+            for (int c = 0; c < cells; ++c) {
+                GLuint v00 = r * verts + c, v10 = v00 + 1, v01 = v00 + verts, v11 = v01 + 1;
+                indices.insert(indices.end(), { v00, v10, v11, v00, v11, v01 });
+            }
+        }
+        indexCount = (GLsizei)indices.size();
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, verts * verts * sizeof(glm::vec3), nullptr, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        glBindVertexArray(0);
+    }
+
+    float size, step;
+    int cells, verts;
+    size_t groups;                   // lane groups per row, the last one padded
+    std::vector<FunnelLanes> height; // verts rows of groups
+    std::vector<FunnelLanes> xs;     // x (and z) of each column
+    std::vector<float> bx, bz, bk;   // body x, z and mass * funnelScale
+    MassQuadtree tree;
+    struct LightBody {
+        float x, z, mass;
+        int row, col;  // cell the body falls in
+        float fu, fv;  // position inside that cell
+    };
+    size_t fftSize = 0;
+    std::vector<std::complex<float>> grid, kernel; // fftSize x fftSize
+    GLuint vao = 0, vbo = 0, ibo = 0;
+    GLsizei indexCount = 0;
+
+    bool computed = false;                  // the first Compute() fills the whole grid, bodies or not
+    std::vector<float> seenX, seenZ, seenK; // bodies as of the last recompute near them
+    int tileRows;
+    std::vector<char> tileDirty;            // tileRows x groups
+    std::vector<uint32_t> dirtyTiles;
+    std::vector<int> rowLo, rowHi;          // column span of each row awaiting upload
+    std::vector<glm::vec3> rowScratch;
+};
@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+#include "arena.h"
+#include "space.h"
+#include "thread_pool.h"
+
+constexpr float gravityG = 6.67430e-1f; // Scaled gravitational constant
+constexpr float softening2 = 1.0f;      // Keeps close encounters finite
+
+// Force exerted on body i by body j, in 3D or in the plane.
+template <class Vec>
+inline Vec PairForce(const Vec& pi, float mi, const Vec& pj, float mj) {
+    Vec dir = pj - pi;
+    float dist2 = glm::dot(dir, dir) + softening2;
+    float dist = std::sqrt(dist2);
+    Vec dirNorm = dir / dist;
+    float forceMag = gravityG * mi * mj / dist2;
+    return dirNorm * forceMag;
+}
+
+// How per-body force sums are combined when the pair loop runs on the pool.
+//
+// Fast evaluates every pair once and applies it to both bodies (Newton's third
+// law). Each worker accumulates into its own buffer and the buffers are added
+// up afterwards, so the rounding depends on the thread count and on which
+// worker happened to pick up which rows.
+//
+// Deterministic splits receivers into fixed-size blocks and sums every source
+// in index order for each receiver, with no cross-thread reduction at all. The
+// result is bitwise identical at any thread count and matches the original
+// single-threaded loop. The price is evaluating each pair twice: expect about
+// 2x the pair-loop time of Fast at the same thread count, minus the per-worker
+// buffer traffic Fast pays (O(threads * N)), which only matters for small N.
+// `gravity_sim --bench-forces N` measures both on the current machine.
+enum class Reduction {
+    Fast,
+    Deterministic
+};
+
+template <class Space>
+class GravitySolver {
+public:
+    using Vec = typename Space::Vec;
+
+    static constexpr size_t blockSize = 64;     // receivers per task, fixed for reproducibility
+    static constexpr size_t parallelMin = 256;  // below this the pool costs more than it saves
+
+    explicit GravitySolver(ThreadPool& pool, Reduction reduction = Reduction::Fast)
+        : reduction(reduction), pool(pool) {}
+
+    Reduction reduction;
+
+    // Writes the total gravitational force on each of the first `receivers`
+    // bodies to forces. Bodies past that only act as sources (static or
+    // prescribed motion), so nothing is computed for them.
+    void ComputeForces(const Vec* pos, const float* mass, size_t n, size_t receivers, Vec* forces) {
+        if (reduction == Reduction::Deterministic)
+            ComputeDeterministic(pos, mass, n, receivers, forces);
+        else
+            ComputeFast(pos, mass, n, receivers, forces);
+    }
+
+private:
+    // Rows [begin, end) of the receiver block: pairs among receivers are
+    // applied to both sides, sources only to the receiver.
+    static void AccumulateRows(const Vec* pos, const float* mass, size_t n, size_t receivers,
+                               size_t begin, size_t end, Vec* out) {
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t j = i + 1; j < receivers; ++j) {
+                Vec f = PairForce(pos[i], mass[i], pos[j], mass[j]);
+                out[i] += f;
+                out[j] -= f;
+            }
+            for (size_t j = receivers; j < n; ++j)
+                out[i] += PairForce(pos[i], mass[i], pos[j], mass[j]);
+        }
+    }
+
+    void ComputeFast(const Vec* pos, const float* mass, size_t n, size_t receivers, Vec* forces) {
+        for (size_t i = 0; i < receivers; ++i) forces[i] = Vec(0.0f);
+        unsigned workers = pool.Size();
+        if (n < parallelMin || workers == 1) {
+            AccumulateRows(pos, mass, n, receivers, 0, receivers, forces);
+            return;
+        }
+
+        ArenaScope scope(pool.Scratch(0));
+        ArenaVector<Vec> partial(workers * receivers, Vec(0.0f), ArenaAllocator<Vec>(pool.Scratch(0)));
+        size_t blocks = (receivers + blockSize - 1) / blockSize;
+        pool.Run(blocks, [&](size_t b, unsigned w) {
+            size_t begin = b * blockSize, end = std::min(begin + blockSize, receivers);
+            AccumulateRows(pos, mass, n, receivers, begin, end, &partial[w * receivers]);
+        });
+        pool.Run(blocks, [&](size_t b, unsigned) {
+            size_t begin = b * blockSize, end = std::min(begin + blockSize, receivers);
+            for (unsigned w = 0; w < workers; ++w) {
+                const Vec* src = &partial[w * receivers];
+                for (size_t i = begin; i < end; ++i) forces[i] += src[i];
+            }
+        });
+    }
+
+    void ComputeDeterministic(const Vec* pos, const float* mass, size_t n, size_t receivers, Vec* forces) {
+        auto block = [&](size_t b, unsigned) {
+            size_t begin = b * blockSize, end = std::min(begin + blockSize, receivers);
+            for (size_t i = begin; i < end; ++i) {
+                Vec totalForce(0.0f);
+                for (size_t j = 0; j < n; ++j) {
+                    if (i == j) continue;
+                    totalForce += PairForce(pos[i], mass[i], pos[j], mass[j]);
+                }
+                forces[i] = totalForce;
+            }
+        };
+        size_t blocks = (receivers + blockSize - 1) / blockSize;
+        if (n < parallelMin) {
+            for (size_t b = 0; b < blocks; ++b) block(b, 0);
+            return;
+        }
+        pool.Run(blocks, block);
+    }
+
+    ThreadPool& pool;
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Encoders for frames read back from GL: RGBA8 pixels, rows bottom to top.
+// Every encoder flips to top-down and drops alpha. Output goes into a
+// caller-owned byte vector so a long recording reuses the same storage.
+enum class ImageFormat { Png, Raw, Y4m };
+
+// Picks the format from the file extension; anything unknown is raw RGB.
+inline ImageFormat ImageFormatFromPath(const std::string& path) {
+    auto endsWith = [&](const char* ext) {
+        size_t n = std::char_traits<char>::length(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".png")) return ImageFormat::Png;
+    if (endsWith(".y4m")) return ImageFormat::Y4m;
+    return ImageFormat::Raw;
+}
+
+inline uint32_t Crc32(uint32_t crc, const uint8_t* data, size_t n) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t Adler32(const uint8_t* data, size_t n) {
+    uint32_t a = 1, b = 0;
+    while (n > 0) {
+        size_t chunk = n < 5552 ? n : 5552; // largest run before b can overflow
+        for (size_t i = 0; i < chunk; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += chunk;
+        n -= chunk;
+    }
+    return b << 16 | a;
+}
+
+inline void PutBigEndian(std::vector<uint8_t>& out, uint32_t v) {
+    out.insert(out.end(), { (uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8), (uint8_t)v });
+}
+
+// Top-down RGB rows, each behind a PNG filter byte when filterBytes is set.
+inline void FlipToRgb(const uint8_t* rgba, int width, int height, bool filterBytes, std::vector<uint8_t>& out) {
+    size_t rowBytes = (size_t)width * 3 + (filterBytes ? 1 : 0);
+    out.resize(rowBytes * height);
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* src = rgba + (size_t)(height - 1 - y) * width * 4;
+        uint8_t* dst = out.data() + (size_t)y * rowBytes;
+        if (filterBytes) *dst++ = 0;
+        for (int x = 0; x < width; ++x, src += 4, dst += 3) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+        }
+    }
+}
+
+// 8-bit RGB PNG whose zlib stream uses stored (uncompressed) deflate
+// blocks: files are larger than a real deflate would give, but encoding is
+// a copy plus two checksums and keeps up with the render loop.
+inline void EncodePng(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& scratch,
+                      std::vector<uint8_t>& out) {
+    FlipToRgb(rgba, width, height, true, scratch);
+    out.clear();
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+    auto chunk = [&](const char* type, auto&& body) {
+        size_t lengthAt = out.size();
+        PutBigEndian(out, 0);
+        out.insert(out.end(), type, type + 4);
+        body();
+        uint32_t length = (uint32_t)(out.size() - lengthAt - 8);
+        for (int k = 0; k < 4; ++k) out[lengthAt + k] = (uint8_t)(length >> (24 - 8 * k));
+        PutBigEndian(out, Crc32(0, out.data() + lengthAt + 4, length + 4));
+    };
+    chunk("IHDR", [&] {
+        PutBigEndian(out, (uint32_t)width);
+        PutBigEndian(out, (uint32_t)height);
+        out.insert(out.end(), { 8, 2, 0, 0, 0 }); // 8 bits, RGB, deflate, no filter, no interlace
+    });
+    chunk("IDAT", [&] {
+        out.insert(out.end(), { 0x78, 0x01 });
+        size_t left = scratch.size();
+        const uint8_t* data = scratch.data();
+        do {
+            uint16_t n = (uint16_t)(left < 65535 ? left : 65535);
+            left -= n;
+            out.insert(out.end(), { (uint8_t)(left == 0), (uint8_t)n, (uint8_t)(n >> 8),
+                                    (uint8_t)~n, (uint8_t)(~n >> 8) });
+            out.insert(out.end(), data, data + n);
+            data += n;
+        } while (left > 0);
+        PutBigEndian(out, Adler32(scratch.data(), scratch.size()));
+    });
+    chunk("IEND", [] {});
+}
+
+inline void EncodeRaw(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& out) {
+    FlipToRgb(rgba, width, height, false, out);
+}
+
+inline std::string Y4mHeader(int width, int height, int fps) {
+    return "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" +
+           std::to_string(fps) + ":1 Ip A1:1 C420jpeg\n";
+}
+
+// One Y4M frame: full-range BT.601 luma per pixel, chroma averaged over 2x2
+// blocks.
+inline void EncodeY4mFrame(const uint8_t* rgba, int width, int height, std::vector<uint8_t>& out) {
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    const char tag[] = "FRAME\n";
+    out.assign(tag, tag + 6);
+    size_t yAt = out.size(), uAt = yAt + (size_t)width * height, vAt = uAt + (size_t)cw * ch;
+    out.resize(vAt + (size_t)cw * ch);
+    auto pixel = [&](int x, int y) { return rgba + ((size_t)(height - 1 - y) * width + x) * 4; };
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const uint8_t* p = pixel(x, y);
+            out[yAt + (size_t)y * width + x] = (uint8_t)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+        }
+    }
+    for (int cy = 0; cy < ch; ++cy) {
+        for (int cx = 0; cx < cw; ++cx) {
+            int r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; ++k) {
+                int x = std::min(2 * cx + (k & 1), width - 1), y = std::min(2 * cy + (k >> 1), height - 1);
+                const uint8_t* p = pixel(x, y);
+                r += p[0];
+                g += p[1];
+                b += p[2];
+            }
+            size_t i = (size_t)cy * cw + cx;
+            out[uAt + i] = (uint8_t)std::min((-43 * r - 85 * g + 128 * b + 4 * 128 * 256 + 512) >> 10, 255);
+            out[vAt + i] = (uint8_t)std::min((128 * r - 107 * g - 21 * b + 4 * 128 * 256 + 512) >> 10, 255);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "memory_stats.h"
+
+// Draws every body as one instanced, camera-facing quad that the vertex
+// shader expands from the body's center to cover its projected sphere; the
+// fragment shader intersects the view ray with the sphere, shades the hit
+// point and writes its depth, so impostors intersect each other and the
+// funnel like real geometry. Vertex cost is four vertices per body instead
+// of a whole tessellated sphere, which is what makes very large scenes
+// drawable. Being triangles, the quads are clipped per pixel and have no
+// size limit, unlike point sprites.
+//
+// Each frame the visible bodies are gathered straight into a mapped
+// instance buffer, center and appearance side by side; appearance (radius
+// and color) rarely changes and is kept on the CPU by SetAppearance().
+//
+// The shader takes the center at attribute location 0 and the appearance
+// (rgb color, radius in w) at location 1, both per instance.
+class ImpostorRenderer {
+public:
+    void Init(GLuint program) {
+        shader = program;
+        glGenVertexArrays(1, &vao);
+        glGenBuffers(1, &instanceBuffer);
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, center));
+        glVertexAttribDivisor(0, 1);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, appearance));
+        glVertexAttribDivisor(1, 1);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Color in xyz, radius in w, one per body in the same order as the
+    // positions passed to Draw().
+    void SetAppearance(const glm::vec4* appearance, size_t n) { this->appearance.assign(appearance, appearance + n); }
+
+    void Draw(const glm::vec3* positions, size_t n, const uint32_t* visible, size_t count) {
+        if (n > appearance.size()) n = appearance.size();
+        if (n == 0 || count == 0) return;
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+        if (count > capacity) {
+            capacity = count + count / 2;
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+        }
+        Instance* out = static_cast<Instance*>(glMapBufferRange(
+            GL_ARRAY_BUFFER, 0, count * sizeof(Instance), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        size_t drawn = 0;
+        for (size_t k = 0; k < count; ++k)
+            if (visible[k] < n) out[drawn++] = { positions[visible[k]], appearance[visible[k]] };
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+
+        glUseProgram(shader);
+        {
+            DriverCallScope driver;
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)drawn);
+        }
+        glUseProgram(0);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+private:
+    struct Instance {
+        glm::vec3 center;
+        glm::vec4 appearance;
+    };
+
+    GLuint shader = 0;
+    GLuint vao = 0;
+    GLuint instanceBuffer = 0;
+    size_t capacity = 0;
+    std::vector<glm::vec4> appearance;
+};
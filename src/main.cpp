@@ -1,14 +1,101 @@
 #include <iostream>
+#include <cctype>
 #include <cmath>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
-#include <GL/glu.h>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
 #include <vector>
+#include "adaptive_funnel.h"
+#include "body_handles.h"
+#include "bvh.h"
+#include "camera_buffer.h"
+#include "ensemble.h"
+#include "frame_recorder.h"
+#include "funnel.h"
+#include "gravity.h"
+#include "impostor_renderer.h"
+#include "memory_stats.h"
+#include "offscreen_target.h"
+#include "orbit_trails.h"
+#include "planet_renderer.h"
+#include "prediction_renderer.h"
+#include "profiler.h"
+#include "simulation.h"
+#include "sphere_mesh.h"
+#include "trajectory_predictor.h"
+
+// Global allocation hooks for memory_stats.h. Each block starts with a
+// header recording its size and the phase and profiler scope that allocated
+// it, placed right before the aligned user pointer.
+struct AllocationHeader {
+    void* block;
+    size_t size;
+    MemoryPhase phase;
+    uint16_t scope;
+};
+
+void* TrackedAllocate(size_t size, size_t align) {
+    align = std::max(align, alignof(AllocationHeader));
+    void* block = std::malloc(size + sizeof(AllocationHeader) + align - 1);
+    if (!block) return nullptr;
+    uintptr_t user = ((uintptr_t)block + sizeof(AllocationHeader) + align - 1) & ~(uintptr_t)(align - 1);
+    MemoryPhase phase = CurrentMemoryPhase();
+    uint16_t scope = MemoryScopeSlot(Profiler::Get().CurrentScope());
+    new ((AllocationHeader*)user - 1) AllocationHeader{ block, size, phase, scope };
+    RecordAllocation(phase, scope, size);
+    return (void*)user;
+}
+
+void TrackedFree(void* p) {
+    if (!p) return;
+    const AllocationHeader* header = (const AllocationHeader*)p - 1;
+    RecordFree(header->phase, header->scope, header->size);
+    std::free(header->block);
+}
+
+void* TrackedNew(size_t size, size_t align) {
+    void* p = TrackedAllocate(size, align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
 
+void* operator new(size_t size) { return TrackedNew(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new[](size_t size) { return TrackedNew(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new(size_t size, std::align_val_t align) { return TrackedNew(size, (size_t)align); }
+void* operator new[](size_t size, std::align_val_t align) { return TrackedNew(size, (size_t)align); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return TrackedAllocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void operator delete(void* p) noexcept { TrackedFree(p); }
+void operator delete[](void* p) noexcept { TrackedFree(p); }
+void operator delete(void* p, size_t) noexcept { TrackedFree(p); }
+void operator delete[](void* p, size_t) noexcept { TrackedFree(p); }
+void operator delete(void* p, std::align_val_t) noexcept { TrackedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { TrackedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { TrackedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { TrackedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { TrackedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { TrackedFree(p); }
+
+// Every thread starts out as Driver; this one is the program's own.
+static const bool mainThreadPhase = (CurrentMemoryPhase() = MemoryPhase::Other, true);
+
+// Every shader is GLSL 3.30 core and sees the camera uniform block.
 GLuint CompileShader(GLenum type, const char* src) {
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &src, nullptr);
+    const char* sources[] = { "#version 330 core\n", cameraBlockSource, src };
+    glShaderSource(shader, 3, sources, nullptr);
     glCompileShader(shader);
 
     GLint success;
@@ -41,6 +128,7 @@ GLuint CreateShaderProgram(const char* vertSrc, const char* fragSrc) {
 
     glDeleteShader(vertexShader);
     glDeleteShader(fragmentShader);
+    CameraBuffer::Attach(program);
     return program;
 }
 
@@ -48,7 +136,6 @@ GLuint CreateShaderProgram(const char* vertSrc, const char* fragSrc) {
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
-void DrawSphere(float radius, int slices, int stacks);
 
 class Sphere {
 public:
@@ -57,6 +144,9 @@ public:
     float radius;
     float color[3];
     float mass;
+    bool isStatic = false; // anchored: pulls on others but never moves
+    bool onPath = false;   // moves along path, pulling on others without being pulled
+    CircularPath path{};
 
     Sphere(float r, float x, float y, float z, float rCol, float gCol, float bCol, float m)
         : radius(r), mass(m)
@@ -106,32 +196,26 @@ public:
         velocity[2] *= 0.99f;
     }
     */
-
-    void ApplyForce(const glm::vec3& force, float dt) {
-        glm::vec3 acceleration = force / mass;
-        velocity += acceleration * dt;
-        velocity.y = 0.0f; //Preventing the movement of the y-axis
-    }
-
-    void Update(float dt) {
-        position += velocity * dt;
-        position.y = 25.0f;
-    }
-
-    void Draw(int slices, int stacks) {
-        glPushMatrix();
-        glTranslatef(position[0], position[1], position[2]);
-        glColor3f(color[0], color[1], color[2]);
-        DrawSphere(radius, slices, stacks);
-        glPopMatrix();
-    }
 };
 
-GLFWwindow* StartGLFW();
-void DrawFloor(float y, float width, float depth);
-void DrawGrid(float size, float step);
-void initLighting();
-void HyperBoloid_Funnel_WithMass(std::vector<Sphere>& planets, float size, float step);
+// Drops element i by moving the last one into its place, which is how the
+// simulation renumbers ids when a body is removed.
+template <class T>
+void SwapRemove(std::vector<T>& v, size_t i) {
+    v[i] = v.back();
+    v.pop_back();
+}
+
+GLFWwindow* StartGLFW(bool headless);
+std::vector<Sphere> CreateSolarSystem();
+void AddDebris(std::vector<Sphere>& planets, size_t count);
+void AddCompanion(std::vector<Sphere>& planets);
+int CheckPrescribed();
+int CheckFunnel(unsigned threads);
+int CheckArena(unsigned threads);
+int BenchmarkForces(size_t n);
+int BenchmarkQueries(size_t n, unsigned threads);
+int RunEnsemble(size_t systems, size_t steps, unsigned threads, bool space3D);
 
 float camRadius = 600.0f;
 float camTheta = M_PI / 2.0f;  // horizontal angle
@@ -141,9 +225,40 @@ float camX, camY, camZ;
 bool rotating = false;
 double lastX = 0, lastY = 0;
 
+// A left press and release within clickSlop pixels is a click, which picks
+// the body under the cursor; anything further is a camera drag.
+constexpr double clickSlop = 4.0;
+double pressX = 0, pressY = 0;
+bool pickPending = false, pickAdditive = false;
+double pickX = 0, pickY = 0;
+
+// Bodies whose future paths are predicted. Handles, since merging bodies
+// renumbers ids.
+std::vector<BodyHandle> selectedBodies;
+bool selectionChanged = false;
+int keySelect = -1; // id typed on the keyboard, resolved in the frame loop
+
+void ToggleSelection(BodyHandle body) {
+    auto it = std::find(selectedBodies.begin(), selectedBodies.end(), body);
+    if (it == selectedBodies.end()) selectedBodies.push_back(body);
+    else selectedBodies.erase(it);
+    selectionChanged = true;
+}
+
 void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) {
-    if (button == GLFW_MOUSE_BUTTON_LEFT)
-        rotating = (action == GLFW_PRESS);
+    if (button != GLFW_MOUSE_BUTTON_LEFT) return;
+    rotating = (action == GLFW_PRESS);
+    double x, y;
+    glfwGetCursorPos(window, &x, &y);
+    if (action == GLFW_PRESS) {
+        pressX = x;
+        pressY = y;
+    } else if (std::abs(x - pressX) <= clickSlop && std::abs(y - pressY) <= clickSlop) {
+        pickPending = true;
+        pickAdditive = (mods & GLFW_MOD_SHIFT) != 0;
+        pickX = x;
+        pickY = y;
+    }
 }
 
 void cursor_position_callback(GLFWwindow* window, double xpos, double ypos) {
@@ -168,31 +283,266 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
     if (camRadius > 2000.0f) camRadius = 2000.0f;
 }
 
+// Click selects the body under the cursor, shift-click adds or removes it,
+// and a click on empty space (a default handle) clears the selection.
+void SelectPicked(BodyHandle body, bool additive) {
+    bool hit = body != BodyHandle{};
+    if (!additive) {
+        bool unchanged = hit && selectedBodies.size() == 1 && selectedBodies[0] == body;
+        if (unchanged) return;
+        selectedBodies.clear();
+        selectionChanged = true;
+    }
+    if (hit) ToggleSelection(body);
+}
+
+// World-space ray through a cursor position given in window coordinates.
+void CursorRay(const glm::mat4& viewProj, double x, double y, int width, int height,
+               glm::vec3& origin, glm::vec3& dir) {
+    glm::vec2 ndc(2.0 * x / width - 1.0, 1.0 - 2.0 * y / height);
+    glm::mat4 inverse = glm::inverse(viewProj);
+    glm::vec4 nearPoint = inverse * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+    origin = glm::vec3(nearPoint) / nearPoint.w;
+    dir = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+}
+
+// 1-9 toggle the prediction for the body with that id, 0 clears it
+void key_callback(GLFWwindow*, int key, int, int action, int) {
+    if (action != GLFW_PRESS) return;
+    if (key >= GLFW_KEY_1 && key <= GLFW_KEY_9) {
+        keySelect = key - GLFW_KEY_0;
+    } else if (key == GLFW_KEY_0) {
+        selectedBodies.clear();
+        selectionChanged = true;
+    }
+}
+
+// Unit-sphere vertices placed per instance: instance.xyz is the center,
+// instance.w the radius.
 const char* vertexShaderSource = R"(
-#version 120
-varying vec3 vNormal;
+layout(location = 0) in vec3 vertex; // also the normal
+layout(location = 1) in vec4 instance;
+layout(location = 2) in vec3 instanceColor;
+out vec3 vNormal;
+out vec3 vColor;
 void main() {
-    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-    vNormal = gl_NormalMatrix * gl_Normal;
-    gl_FrontColor = gl_Color;
+    vec4 world = vec4(instance.xyz + vertex * instance.w, 1.0);
+    gl_Position = viewProjection * world;
+    vNormal = mat3(view) * vertex;
+    vColor = instanceColor;
 }
 )";
 
 const char* fragmentShaderSource = R"(
-#version 120
-varying vec3 vNormal;
+in vec3 vNormal;
+in vec3 vColor;
+out vec4 fragColor;
 void main() {
     float lighting = max(dot(normalize(vNormal), vec3(0, 0, 1)), 0.3);
-    gl_FragColor = vec4(gl_Color.rgb * lighting, 1.0);
+    fragColor = vec4(vColor * lighting, 1.0);
 }
 )";
 
+// Impostors: one camera-facing quad per body, expanded from the instance
+// center by corner (gl_VertexID of a 4-vertex strip). The quad lies in the
+// plane through the center perpendicular to the line of sight, sized to
+// hold the sphere's silhouette circle, so it covers the projected sphere at
+// any distance and is clipped like any triangle. appearance.rgb is the
+// color, appearance.w the radius.
+const char* impostorVertexSource = R"(
+layout(location = 0) in vec3 center;
+layout(location = 1) in vec4 appearance;
+out vec3 vPosition;
+flat out vec3 vCenter;
+flat out float vRadius;
+flat out vec3 vColor;
+void main() {
+    vec3 eye = (view * vec4(center, 1.0)).xyz;
+    float r = appearance.w;
+    float d = max(length(eye), 1.001 * r);
+    vec3 forward = eye / d;
+    vec3 side = normalize(cross(forward, abs(forward.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+    vec3 up = cross(side, forward);
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+    vPosition = eye + (corner.x * side + corner.y * up) * (r * d / sqrt(d * d - r * r));
+    gl_Position = projection * vec4(vPosition, 1.0);
+    vCenter = eye;
+    vRadius = r;
+    vColor = appearance.rgb;
+}
+)";
 
+// Intersects the view ray through the fragment with the sphere, shades the
+// hit point and moves the fragment to its depth.
+const char* impostorFragmentSource = R"(
+in vec3 vPosition;
+flat in vec3 vCenter;
+flat in float vRadius;
+flat in vec3 vColor;
+out vec4 fragColor;
+void main() {
+    vec3 ray = normalize(vPosition);
+    float b = dot(ray, vCenter);
+    float h = b * b - dot(vCenter, vCenter) + vRadius * vRadius;
+    if (h < 0.0) discard;
+    vec3 hit = ray * (b - sqrt(h));
+    vec3 normal = (hit - vCenter) / vRadius;
+    vec4 clip = projection * vec4(hit, 1.0);
+    float ndcDepth = clip.z / clip.w;
+    gl_FragDepth = 0.5 * (gl_DepthRange.diff * ndcDepth + gl_DepthRange.near + gl_DepthRange.far);
+    float lighting = max(normal.z, 0.3);
+    fragColor = vec4(vColor * lighting, 1.0);
+}
+)";
 
+// Lines in a flat color: the funnel wireframe and predicted paths.
+const char* lineVertexSource = R"(
+layout(location = 0) in vec3 position;
+void main() {
+    gl_Position = viewProjection * vec4(position, 1.0);
+}
+)";
 
+const char* lineFragmentSource = R"(
+uniform vec3 color;
+out vec4 fragColor;
+void main() {
+    fragColor = vec4(color, 1.0);
+}
+)";
 
-int main() {
-    GLFWwindow* window = StartGLFW();
+// Orbit trails, fading out with age. Trail vertices are stored slot-major,
+// so the vertex id gives the ring slot.
+const char* trailVertexSource = R"(
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 trailColor;
+uniform int newest;
+uniform int bodies;
+uniform int length;
+out vec4 vColor;
+void main() {
+    int slot = gl_VertexID / bodies;
+    float age = float((newest - slot + length) % length) / float(length);
+    gl_Position = viewProjection * vec4(position, 1.0);
+    vColor = vec4(trailColor, 1.0 - age);
+}
+)";
+
+const char* trailFragmentSource = R"(
+in vec4 vColor;
+out vec4 fragColor;
+void main() {
+    fragColor = vColor;
+}
+)";
+
+int main(int argc, char** argv) {
+    Reduction reduction = Reduction::Fast;
+    unsigned threads = 0;
+    bool space3D = false;
+    bool impostors = false;
+    FunnelMode funnelMode = FunnelMode::Direct;
+    float funnelTheta = 0.5f;
+    bool adaptiveFunnel = false;
+    size_t benchBodies = 0, queryBodies = 0, ensembleSystems = 0, ensembleSteps = 10000;
+    bool headless = false;
+    const char* recordPath = nullptr;
+    size_t recordFps = 60, maxFrames = 0;
+    size_t trailLength = 0;
+    float predictHorizon = 0.0f;
+    std::vector<size_t> initialSelection;
+    bool mergers = false;
+    size_t debris = 0;
+    bool companion = false;
+    bool memoryStats = false;
+    size_t allocationWarmup = 0; // frames before --check-allocations starts checking, 0 for off
+    const char* profilePath = nullptr;
+    auto count = [&](int& i, size_t fallback) {
+        return i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]) ? (size_t)atoll(argv[++i]) : fallback;
+    };
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--deterministic")) {
+            reduction = Reduction::Deterministic;
+        } else if (!strcmp(argv[i], "--threads")) {
+            threads = (unsigned)count(i, 0);
+        } else if (!strcmp(argv[i], "--3d")) {
+            space3D = true;
+        } else if (!strcmp(argv[i], "--impostors")) {
+            impostors = true;
+        } else if (!strcmp(argv[i], "--funnel") && i + 1 < argc && !strcmp(argv[i + 1], "direct")) {
+            funnelMode = FunnelMode::Direct;
+            ++i;
+        } else if (!strcmp(argv[i], "--funnel") && i + 1 < argc && !strcmp(argv[i + 1], "tree")) {
+            funnelMode = FunnelMode::Tree;
+            ++i;
+        } else if (!strcmp(argv[i], "--funnel") && i + 1 < argc && !strcmp(argv[i + 1], "fft")) {
+            funnelMode = FunnelMode::Fft;
+            ++i;
+        } else if (!strcmp(argv[i], "--adaptive-funnel")) {
+            adaptiveFunnel = true;
+        } else if (!strcmp(argv[i], "--funnel-theta") && i + 1 < argc) {
+            funnelTheta = (float)atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-forces")) {
+            benchBodies = count(i, 4096);
+        } else if (!strcmp(argv[i], "--bench-queries")) {
+            queryBodies = count(i, 1000000);
+        } else if (!strcmp(argv[i], "--ensemble")) {
+            ensembleSystems = count(i, 4096);
+            ensembleSteps = count(i, ensembleSteps);
+        } else if (!strcmp(argv[i], "--trails")) {
+            trailLength = std::max<size_t>(count(i, 512), 2);
+        } else if (!strcmp(argv[i], "--predict")) {
+            predictHorizon = 20.0f;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) predictHorizon = (float)atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--select") && i + 1 < argc) {
+            initialSelection.push_back((size_t)atoll(argv[++i]));
+        } else if (!strcmp(argv[i], "--mergers")) {
+            mergers = true;
+        } else if (!strcmp(argv[i], "--debris")) {
+            debris = count(i, 200);
+        } else if (!strcmp(argv[i], "--companion")) {
+            companion = true;
+        } else if (!strcmp(argv[i], "--check-prescribed")) {
+            return CheckPrescribed();
+        } else if (!strcmp(argv[i], "--check-funnel")) {
+            return CheckFunnel(threads);
+        } else if (!strcmp(argv[i], "--check-arena")) {
+            return CheckArena(threads);
+        } else if (!strcmp(argv[i], "--memory-stats")) {
+            memoryStats = true;
+        } else if (!strcmp(argv[i], "--check-allocations")) {
+            allocationWarmup = std::max<size_t>(count(i, 120), 1);
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (!strcmp(argv[i], "--headless")) {
+            headless = true;
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "--fps")) {
+            recordFps = std::max<size_t>(count(i, recordFps), 1);
+        } else if (!strcmp(argv[i], "--frames")) {
+            maxFrames = count(i, 0);
+        } else {
+            std::cerr << "Unknown option " << argv[i] << "\n";
+            return 1;
+        }
+    }
+    // Profiler scopes also tag allocations by subsystem
+    if (profilePath || memoryStats || allocationWarmup) {
+        Profiler::Get().Enable();
+        Profiler::Get().NameThread("main");
+    }
+    if (benchBodies) return BenchmarkForces(benchBodies);
+    if (queryBodies) return BenchmarkQueries(queryBodies, threads);
+    if (ensembleSystems) return RunEnsemble(ensembleSystems, ensembleSteps, threads, space3D);
+
+    if (headless && !maxFrames) {
+        std::cerr << "--headless needs --frames N\n";
+        return 1;
+    }
+
+    GLFWwindow* window = StartGLFW(headless);
     if (!window) return -1;
 
     glfwMakeContextCurrent(window);
@@ -200,9 +550,27 @@ int main() {
         std::cerr << "Failed to initialize GLAD\n";
         return -1;
     }
+    if (!GLAD_GL_VERSION_3_3) {
+        std::cerr << "OpenGL 3.3 is required\n";
+        return -1;
+    }
+    CameraBuffer cameraBuffer;
+    cameraBuffer.Init();
     GLuint planetShader = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
-
-    initLighting();
+    PlanetRenderer planetRenderer;
+    planetRenderer.Init(planetShader);
+    ImpostorRenderer impostorRenderer;
+    impostorRenderer.Init(CreateShaderProgram(impostorVertexSource, impostorFragmentSource));
+    GLuint lineShader = CreateShaderProgram(lineVertexSource, lineFragmentSource);
+    GLint lineColorLoc = glGetUniformLocation(lineShader, "color");
+
+    // Recorded and headless frames are drawn offscreen; a visible window
+    // gets a copy of each.
+    OffscreenTarget offscreen;
+    FrameRecorder recorder;
+    bool useOffscreen = headless || recordPath;
+    if (useOffscreen && !offscreen.Init(800, 600)) return -1;
+    if (recordPath && !recorder.Open(recordPath, 800, 600, (int)recordFps)) return -1;
 
     glViewport(0, 0, 800, 600);
     glEnable(GL_DEPTH_TEST);
@@ -211,10 +579,10 @@ int main() {
     glfwSetMouseButtonCallback(window, mouse_button_callback);
     glfwSetCursorPosCallback(window, cursor_position_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
 
 
     float radius = 30.0f;
-    int slices = 20, stacks = 20;
 
     float worldHeight = 800.0f, worldWidth = 1000.0f, worldDepth = 400.0f;
     float prevTime = glfwGetTime();
@@ -223,86 +591,114 @@ int main() {
     //float position[3] = { 0.0f, 200.0f, 0.0f };
     //float velocity[3] = { 0.0f, 0.0f, 0.0f };
 
-    std::vector<Sphere> planets;
-
-    // Sun
-    planets.emplace_back(60.0f, 0.0f, 25.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.989e6f);
-
-    // Mercury
-    Sphere mercury(5.0f, 100.0f, 25.0f, 0.0f, 0.5f, 0.5f, 0.5f, 0.33f);
-    mercury.velocity.z = 130.0f;
-    planets.push_back(mercury);
-
-    // Venus
-    Sphere venus(10.0f, 150.0f, 25.0f, 0.0f, 0.9f, 0.7f, 0.2f, 4.87f);
-    venus.velocity.z = 108.0f;
-    planets.push_back(venus);
-
-    // Earth
-    Sphere earth(12.0f, 200.0f, 25.0f, 0.0f, 0.2f, 0.2f, 1.0f, 5.97f);
-    earth.velocity.z = 98.0f;
-    planets.push_back(earth);
-
-    // Mars
-    Sphere mars(10.0f, 250.0f, 25.0f, 0.0f, 1.0f, 0.3f, 0.1f, 0.64f);
-    mars.velocity.z = 85.0f;
-    planets.push_back(mars);
-
-    // Jupiter
-    Sphere jupiter(25.0f, 350.0f, 25.0f, 0.0f, 1.0f, 0.9f, 0.6f, 1898.0f);
-    jupiter.velocity.z = 50.0f;
-    planets.push_back(jupiter);
-    /*
-    // dummy planet with the mass of sun
-    Sphere dummy(25.0f, 350.0f, 25.0f, 0.0f, 1.0f, 0.9f, 0.6f, 1.989e6f);
-    dummy.velocity.z = 50.0f;
-    planets.push_back(dummy);
-    */
-
-    // Saturn
-    Sphere saturn(22.0f, 450.0f, 25.0f, 0.0f, 1.0f, 0.8f, 0.4f, 568.0f);
-    saturn.velocity.z = 40.0f;
-    planets.push_back(saturn);
-
-    // Uranus
-    Sphere uranus(18.0f, 550.0f, 25.0f, 0.0f, 0.6f, 0.8f, 1.0f, 86.8f);
-    uranus.velocity.z = 30.0f;
-    planets.push_back(uranus);
-
-    // Neptune
-    Sphere neptune(17.0f, 650.0f, 25.0f, 0.0f, 0.4f, 0.4f, 1.0f, 102.0f);
-    neptune.velocity.z = 25.0f;
-    planets.push_back(neptune);
-
+    std::vector<Sphere> planets = CreateSolarSystem();
+    AddDebris(planets, debris);
+    if (companion) AddCompanion(planets);
+    planetRenderer.Reserve(planets.size());
 
     //ball1.velocity = glm::vec3(0.0f, 0.0f, 20.0f);  // optional initial nudge
+
+    // The default scene lives in the plane y = 25; --3d simulates all axes.
+    float planeY = 25.0f;
+    ThreadPool pool(threads);
+    std::unique_ptr<Simulation> sim;
+    if (space3D)
+        sim = std::make_unique<SpaceSimulation<Space3D>>(pool, reduction, planeY);
+    else
+        sim = std::make_unique<SpaceSimulation<PlaneXZ>>(pool, reduction, planeY);
+    for (const auto& planet : planets) {
+        if (planet.onPath)
+            sim->AddPrescribedBody(planet.path, planet.mass);
+        else
+            sim->AddBody(planet.position, planet.velocity, planet.mass,
+                         planet.isStatic ? Motion::Static : Motion::Dynamic);
+    }
+    for (size_t id : initialSelection)
+        if (id < sim->Size()) ToggleSelection(sim->HandleOf(id));
+    std::vector<glm::vec3> bodyPos(sim->Size());
+    std::vector<glm::vec4> appearance;
+    for (const auto& planet : planets)
+        appearance.push_back(glm::vec4(planet.color[0], planet.color[1], planet.color[2], planet.radius));
+    impostorRenderer.SetAppearance(appearance.data(), appearance.size());
+    planetRenderer.SetAppearance(appearance.data(), appearance.size());
+    std::vector<float> bodyRadius, bodyMass;
+    for (const auto& planet : planets) {
+        bodyRadius.push_back(planet.radius);
+        bodyMass.push_back(planet.mass);
+    }
+    FunnelSurface funnel(500.0f, 15.0f);
+    funnel.mode = funnelMode;
+    funnel.theta = funnelTheta;
+    AdaptiveFunnel adaptive(500.0f);
+    std::vector<glm::vec3> bodyColors;
+    for (const auto& planet : planets) bodyColors.push_back(glm::vec3(planet.color[0], planet.color[1], planet.color[2]));
+    OrbitTrails trails(trailLength ? planets.size() : 0, std::max<size_t>(trailLength, 1));
+    if (trailLength) trails.Init(CreateShaderProgram(trailVertexSource, trailFragmentSource), bodyColors.data());
+    // Predictions restart at once when the selection changes, and are
+    // otherwise refreshed every predictRefresh time units once the worker
+    // is idle.
+    bool predict = predictHorizon > 0.0f;
+    const float predictRefresh = 1.0f;
+    float lastRequestTime = 0.0f;
+    TrajectoryPredictor predictor;
+    predictor.horizon = predictHorizon;
+    predictor.Reserve(sim->Size());
+    SimulationSnapshot snapshot;
+    snapshot.Reserve(sim->Size());
+    std::vector<size_t> selectedIds;
+    Prediction prediction;
+    uint64_t firstCurrentPrediction = 0; // older ones use ids from before a merger
+    PredictionRenderer predictionRenderer;
+    predictionRenderer.Init(lineShader, lineColorLoc);
+    Bvh bvh;
+    std::vector<uint32_t> visible;
+    visible.reserve(planets.size());
+    std::vector<std::pair<uint32_t, uint32_t>> encounters;
+    std::vector<std::pair<BodyHandle, BodyHandle>> contacts;
     
 
 
 
-    while (!glfwWindowShouldClose(window)) {
+    // With --check-allocations, any allocation outside Background threads
+    // and GL driver calls after the warm-up frames ends the run with a
+    // report and exit code 1.
+    size_t frame = 0;
+    bool allocationFailure = false;
+    while (!glfwWindowShouldClose(window) && (!maxFrames || frame < maxFrames)) {
         float currTime = glfwGetTime();
         float deltaTime = currTime - prevTime;   //calculate the time diff between each frame
         prevTime = currTime;
         if (deltaTime > 0.1f) deltaTime = 0.1f;
-
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // Recordings advance by the frame interval so playback runs at real speed
+        if (recordPath) deltaTime = 1.0f / (float)recordFps;
+        ++frame;
+        ProfileScope frameScope("frame");
+        pool.ResetScratch(); // step boundary
+        uint64_t allocationsBefore = ForegroundAllocations();
+
+        if (useOffscreen) offscreen.Bind();
+        {
+            DriverCallScope driver;
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
 
         // Camera & Projection
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
         float fov = 45.0f, aspect = 800.0f / 600.0f;
         float near = 0.1f, far = 1000.0f;
         float top = tan(fov * 0.5f * M_PI / 180.0f) * near;
         float right = top * aspect;
-        glFrustum(-right, right, -top, top, near, far);
-        
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
         camX = camRadius * cosf(camPhi) * sinf(camTheta);
         camY = camRadius * sinf(camPhi);
         camZ = camRadius * cosf(camPhi) * cosf(camTheta);
-        gluLookAt(camX, camY, camZ, 0, 0, 0, 0, 1, 0);
+        CameraUniforms camera;
+        camera.projection = glm::frustum(-right, right, -top, top, near, far);
+        camera.view = glm::lookAt(glm::vec3(camX, camY, camZ), glm::vec3(0.0f), glm::vec3(0, 1, 0));
+        camera.viewProjection = camera.projection * camera.view;
+        float focal = 600.0f / (2.0f * top / near);
+        camera.viewport = glm::vec4(800.0f, 600.0f, focal, 0.0f);
+        cameraBuffer.Update(camera);
+        planetRenderer.SetCamera(glm::vec3(camX, camY, camZ), focal);
+        glm::mat4 viewProj = camera.viewProjection;
         /*
         // Physics
         velocity[1] += gravity * deltaTime;
@@ -337,171 +733,614 @@ int main() {
         //velocity[0] *= 0.99f;
         //velocity[2] *= 0.99f;
         
-        // Draw Spherefor this 
-        glPushMatrix();
-        //glTranslatef(position[0], position[1], position[2]);
-        glColor3f(1.0f, 1.0f, 1.0f);
-        for (size_t i = 0; i < planets.size(); ++i) {
-            glm::vec3 totalForce(0.0f);
-
-            for (size_t j = 0; j < planets.size(); ++j) {
-                if (i == j) continue;
-
-                glm::vec3 dir = planets[j].position - planets[i].position;
-                float dist2 = glm::dot(dir, dir) + 1.0f;
-                float dist = sqrt(dist2);
-                glm::vec3 dirNorm = dir / dist;
-
-                float G = 6.67430e-1f; // Scaled gravitational constant
-                float forceMag = G * planets[i].mass * planets[j].mass / dist2;
-                totalForce += dirNorm * forceMag;
+        sim->Step(deltaTime);
+        sim->GetPositions(bodyPos.data());
+        bvh.Update(bodyPos.data(), bodyRadius.data(), bodyPos.size());
+
+        // Touching bodies merge: the lighter one is folded into the heavier
+        // and removed, and every array indexed by id follows with the same
+        // swap-remove. Contacts are held by handle since each merger
+        // renumbers a body.
+        if (mergers && !bodyPos.empty()) {
+            float maxRadius = *std::max_element(bodyRadius.begin(), bodyRadius.end());
+            bvh.CloseEncounters(pool, 2.0f * maxRadius, encounters);
+            contacts.clear();
+            for (auto [a, b] : encounters) {
+                if (glm::distance(bodyPos[a], bodyPos[b]) >= bodyRadius[a] + bodyRadius[b]) continue;
+                if (bodyMass[a] < bodyMass[b]) std::swap(a, b);
+                contacts.emplace_back(sim->HandleOf(a), sim->HandleOf(b));
             }
+            bool merged = false;
+            for (const auto& contact : contacts) {
+                size_t keep = sim->IdOf(contact.first), lose = sim->IdOf(contact.second);
+                if (!sim->MergeBodies(contact.first, contact.second)) continue;
+                Sphere& survivor = planets[keep];
+                survivor.radius = std::cbrt(std::pow(survivor.radius, 3.0f) + std::pow(planets[lose].radius, 3.0f));
+                survivor.mass += planets[lose].mass;
+                bodyRadius[keep] = survivor.radius;
+                bodyMass[keep] = survivor.mass;
+                appearance[keep].w = survivor.radius;
+                SwapRemove(planets, lose);
+                SwapRemove(bodyRadius, lose);
+                SwapRemove(bodyMass, lose);
+                SwapRemove(appearance, lose);
+                SwapRemove(bodyColors, lose);
+                if (trailLength) trails.RemoveBody(lose, bodyColors.data());
+                merged = true;
+            }
+            if (merged) {
+                bodyPos.resize(sim->Size());
+                sim->GetPositions(bodyPos.data());
+                bvh.Update(bodyPos.data(), bodyRadius.data(), bodyPos.size());
+                impostorRenderer.SetAppearance(appearance.data(), appearance.size());
+                planetRenderer.SetAppearance(appearance.data(), appearance.size());
+                selectedBodies.erase(std::remove_if(selectedBodies.begin(), selectedBodies.end(),
+                                                    [&](BodyHandle h) { return sim->IdOf(h) == BodyHandles::npos; }),
+                                     selectedBodies.end());
+                prediction.bodies.clear();
+                selectionChanged = true;
+                firstCurrentPrediction = UINT64_MAX;
+            }
+        }
 
-            planets[i].ApplyForce(totalForce, deltaTime);
+        if (trailLength) trails.Update(bodyPos.data(), deltaTime);
+        if (keySelect >= 0) {
+            if ((size_t)keySelect < sim->Size()) ToggleSelection(sim->HandleOf((size_t)keySelect));
+            keySelect = -1;
         }
-        glUseProgram(planetShader);
-        for (auto& planet : planets) {
-            planet.Update(deltaTime);
-            planet.Draw(slices, stacks);
+        bool refreshDue = !selectedBodies.empty() && !predictor.Busy() &&
+                          sim->Time() - lastRequestTime >= predictRefresh;
+        if (predict && (selectionChanged || refreshDue)) {
+            sim->GetSnapshot(snapshot);
+            selectedIds.clear();
+            for (BodyHandle body : selectedBodies) selectedIds.push_back(sim->IdOf(body));
+            uint64_t version = predictor.Request(snapshot, selectedIds);
+            if (firstCurrentPrediction == UINT64_MAX) firstCurrentPrediction = version;
+            selectionChanged = false;
+            lastRequestTime = sim->Time();
         }
-        glUseProgram(0);
-
+        if (predict && predictor.Poll(prediction)) {
+            if (prediction.version < firstCurrentPrediction) prediction.bodies.clear();
+            else predictionRenderer.Upload(prediction);
+        }
+        if (pickPending) {
+            int width, height;
+            glfwGetWindowSize(window, &width, &height);
+            glm::vec3 origin, dir;
+            CursorRay(viewProj, pickX, pickY, width, height, origin, dir);
+            uint32_t hit = bvh.Raycast(origin, dir, bodyPos.data(), bodyRadius.data());
+            SelectPicked(hit == Bvh::noHit ? BodyHandle{} : sim->HandleOf(hit), pickAdditive);
+            pickPending = false;
+        }
+        {
+            MemoryPhaseScope renderPhase(MemoryPhase::Render);
+            ProfileScope drawScope("draw");
+            visible.clear();
+            bvh.Cull(Frustum::FromMatrix(viewProj), [&](uint32_t i) { visible.push_back(i); });
+            if (impostors) {
+                impostorRenderer.Draw(bodyPos.data(), bodyPos.size(), visible.data(), visible.size());
+            } else {
+                planetRenderer.Draw(bodyPos.data(), bodyPos.size(), visible.data(), visible.size());
+            }
 
-        glPopMatrix();
-        
-        //DrawFloor(0.0f, 800.0f, 400.0f);
-        //DrawGrid(1000.0f,50.0f);
-        HyperBoloid_Funnel_WithMass(planets, 500.0f, 15.0f);
-        glfwSwapBuffers(window);
+            // The fixed-function funnel was 0.9 grey but lit, with whatever
+            // normal the last sphere vertex left behind, so it showed at
+            // roughly half that; the unlit line shader draws it at that level.
+            glUseProgram(lineShader);
+            glUniform3f(lineColorLoc, 0.45f, 0.45f, 0.45f);
+            if (adaptiveFunnel) {
+                adaptive.Update(bodyPos.data(), bodyMass.data(), bodyPos.size());
+                adaptive.Draw();
+            } else {
+                funnel.Compute(pool, bodyPos.data(), bodyMass.data(), bodyPos.size());
+                funnel.Draw();
+            }
+            glUseProgram(0);
+            if (predict) predictionRenderer.Draw(prediction, sim->Time(), bodyColors.data());
+            if (trailLength) trails.Draw();
+        }
+        if (recordPath) {
+            MemoryPhaseScope ioPhase(MemoryPhase::Io);
+            recorder.Capture();
+        }
+        if (!headless) {
+            if (useOffscreen) offscreen.BlitToWindow();
+            ProfileScope swapScope("swap");
+            DriverCallScope driver;
+            glfwSwapBuffers(window);
+        }
         glfwPollEvents();
-        
+
+        uint64_t allocations = ForegroundAllocations() - allocationsBefore;
+        if (allocationWarmup && frame > allocationWarmup && allocations > 0) {
+            std::cerr << "Frame " << frame << " allocated " << allocations << " times after warm-up\n";
+            PrintMemoryStats(std::cerr);
+            allocationFailure = true;
+            break;
+        }
     }
 
+    {
+        MemoryPhaseScope ioPhase(MemoryPhase::Io);
+        recorder.Close();
+    }
+    if (memoryStats) PrintMemoryStats(std::cout);
+    if (profilePath) {
+        if (!Profiler::Get().WriteChromeTrace(profilePath)) std::cerr << "Cannot write " << profilePath << "\n";
+        Profiler::Get().PrintSummary(std::cout);
+    }
     glfwTerminate();
-    return 0;
+    return allocationFailure ? 1 : 0;
 }
 
-GLFWwindow* StartGLFW() {
-    if (!glfwInit()) return nullptr;
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-    return glfwCreateWindow(800, 600, "3D Gravity Sim (No GLU/GLUT)", NULL, NULL);
-}
+std::vector<Sphere> CreateSolarSystem() {
+    std::vector<Sphere> planets;
+
+    // Sun, anchored: its wobble is negligible and not worth a force loop
+    planets.emplace_back(60.0f, 0.0f, 25.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.989e6f);
+    planets.back().isStatic = true;
 
-void DrawFloor(float y, float width, float depth) {
-    glPushMatrix();
-    glBegin(GL_QUADS);
-    glColor3f(0.2f, 0.5f, 0.2f); // greenish floor
+    // Mercury
+    Sphere mercury(5.0f, 100.0f, 25.0f, 0.0f, 0.5f, 0.5f, 0.5f, 0.33f);
+    mercury.velocity.z = 130.0f;
+    planets.push_back(mercury);
 
-    glNormal3f(0, 1, 0);
-    glVertex3f(-width/2, y, -depth/2);
-    glVertex3f( width/2, y, -depth/2);
-    glVertex3f( width/2, y,  depth/2);
-    glVertex3f(-width/2, y,  depth/2);
+    // Venus
+    Sphere venus(10.0f, 150.0f, 25.0f, 0.0f, 0.9f, 0.7f, 0.2f, 4.87f);
+    venus.velocity.z = 108.0f;
+    planets.push_back(venus);
 
-    glEnd();
-    glPopMatrix();
-}
+    // Earth
+    Sphere earth(12.0f, 200.0f, 25.0f, 0.0f, 0.2f, 0.2f, 1.0f, 5.97f);
+    earth.velocity.z = 98.0f;
+    planets.push_back(earth);
 
-void DrawSphere(float radius, int slices, int stacks) {   //stacks => latitudes , slices => longitudes
-    for (int i = 0; i < stacks; ++i) {
-        float lat0 = M_PI * (-0.5f + (float)i / stacks);
-        float z0 = sin(lat0), zr0 = cos(lat0);
-        
-        float lat1 = M_PI * (-0.5f + (float)(i + 1) / stacks);
-        float z1 = sin(lat1), zr1 = cos(lat1);
+    // Mars
+    Sphere mars(10.0f, 250.0f, 25.0f, 0.0f, 1.0f, 0.3f, 0.1f, 0.64f);
+    mars.velocity.z = 85.0f;
+    planets.push_back(mars);
+
+    // Jupiter
+    Sphere jupiter(25.0f, 350.0f, 25.0f, 0.0f, 1.0f, 0.9f, 0.6f, 1898.0f);
+    jupiter.velocity.z = 50.0f;
+    planets.push_back(jupiter);
+    /*
+    // dummy planet with the mass of sun
+    Sphere dummy(25.0f, 350.0f, 25.0f, 0.0f, 1.0f, 0.9f, 0.6f, 1.989e6f);
+    dummy.velocity.z = 50.0f;
+    planets.push_back(dummy);
+    */
 
-        glBegin(GL_QUAD_STRIP);
-        for (int j = 0; j <= slices; ++j) {
-            float lng = 2 * M_PI * (float)j / slices;
-            float x = cos(lng), y = sin(lng);
+    // Saturn
+    Sphere saturn(22.0f, 450.0f, 25.0f, 0.0f, 1.0f, 0.8f, 0.4f, 568.0f);
+    saturn.velocity.z = 40.0f;
+    planets.push_back(saturn);
 
-            glNormal3f(x * zr0, y * zr0, z0);
-            glVertex3f(x * zr0 * radius, y * zr0 * radius, z0 * radius);
+    // Uranus
+    Sphere uranus(18.0f, 550.0f, 25.0f, 0.0f, 0.6f, 0.8f, 1.0f, 86.8f);
+    uranus.velocity.z = 30.0f;
+    planets.push_back(uranus);
 
-            glNormal3f(x * zr1, y * zr1, z1);
-            glVertex3f(x * zr1 * radius, y * zr1 * radius, z1 * radius);            
-        }
-        glEnd();
+    // Neptune
+    Sphere neptune(17.0f, 650.0f, 25.0f, 0.0f, 0.4f, 0.4f, 1.0f, 102.0f);
+    neptune.velocity.z = 25.0f;
+    planets.push_back(neptune);
+
+    return planets;
+}
+
+// A belt of small bodies between Mars and Jupiter on mildly eccentric,
+// crossing orbits, for exercising --mergers.
+void AddDebris(std::vector<Sphere>& planets, size_t count) {
+    std::mt19937 rng(2024);
+    std::uniform_real_distribution<float> orbit(270.0f, 330.0f), angle(0.0f, 2.0f * (float)M_PI), speed(0.85f, 1.1f);
+    float sunGM = gravityG * planets[0].mass;
+    for (size_t i = 0; i < count; ++i) {
+        float r = orbit(rng), a = angle(rng);
+        Sphere rock(2.0f, r * cosf(a), 25.0f, r * sinf(a), 0.6f, 0.55f, 0.5f, 0.01f);
+        float v = sqrtf(sunGM / r) * speed(rng);
+        rock.velocity = v * glm::vec3(-sinf(a), 0.0f, cosf(a));
+        planets.push_back(rock);
     }
 }
 
-void DrawGrid(float size, float step){
-    glPushMatrix();
-    glColor3f(0.3f, 0.3f, 0.3f);
-    
-    glBegin(GL_LINES);
-    for(float i= -size; i <= size ; i += step){
-        //vertical lines (x axis)
-        glVertex3f(i, 0, -step);
-        glVertex3f(i, 0, step);
+// A heavy body on a fixed circle outside Neptune's orbit, moving at the
+// circular speed for the Sun. Being prescribed, it tugs on the outer planets
+// but stays on its circle however they pull back.
+void AddCompanion(std::vector<Sphere>& planets) {
+    float r = 800.0f;
+    Sphere companion(30.0f, r, 25.0f, 0.0f, 0.9f, 0.4f, 0.4f, 2.0e4f);
+    companion.onPath = true;
+    companion.path = { glm::vec3(0.0f, 25.0f, 0.0f), r, sqrtf(gravityG * planets[0].mass / r) / r, 0.0f };
+    planets.push_back(companion);
+}
 
-        //horizontal lines (z axis)
-        glVertex3f(-size,0,i);
-        glVertex3f(size,0,i);
+// Headless runs use GLFW's null platform, which needs no display server,
+// with an EGL context, falling back to OSMesa's software renderer. The
+// window is never shown; all drawing goes to an offscreen target.
+GLFWwindow* StartGLFW(bool headless) {
+    if (headless) glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+    if (!glfwInit()) return nullptr;
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+    if (!headless) return glfwCreateWindow(800, 600, "3D Gravity Sim (No GLU/GLUT)", NULL, NULL);
+
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    for (int api : { GLFW_EGL_CONTEXT_API, GLFW_OSMESA_CONTEXT_API }) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, api);
+        if (GLFWwindow* window = glfwCreateWindow(800, 600, "3D Gravity Sim", NULL, NULL)) return window;
     }
-    glEnd();
-    glPopMatrix();
+    std::cerr << "No EGL or OSMesa context available for headless rendering\n";
+    return nullptr;
+}
 
+// Time per step of an N-body system through the unrolled FixedSystem kernel
+// and through GravitySolver plus BodyStore::Integrate, the two paths
+// SpaceSimulation::Step chooses between; best of several runs, in ns.
+template <class Space, size_t N>
+void BenchmarkSmallSystem(const char* space) {
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<float> coord(-500.0f, 500.0f);
+    BodyStore<Space> fixed, generic;
+    for (size_t i = 0; i < N; ++i) {
+        glm::vec3 p(coord(rng), coord(rng), coord(rng));
+        fixed.Add(Space::FromWorld(p), typename Space::Vec(0.0f), 1.0f + (float)i);
+        generic.Add(Space::FromWorld(p), typename Space::Vec(0.0f), 1.0f + (float)i);
+    }
+    ThreadPool pool(1);
+    GravitySolver<Space> solver(pool, Reduction::Fast);
+    std::vector<typename Space::Vec> forces(N);
+    const int reps = (int)(400000 / N);
+    const float dt = 1e-6f;
+    double ns[2] = { 1e30, 1e30 };
+    for (int run = 0; run < 5; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) StepFixed<N, Space>(fixed, dt);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        ns[0] = std::min(ns[0], elapsed.count() / reps);
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) {
+            solver.ComputeForces(generic.position.data(), generic.mass.data(), N, N, forces.data());
+            generic.Integrate(forces.data(), dt);
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        ns[1] = std::min(ns[1], elapsed.count() / reps);
+    }
+    std::cout << space << " N=" << N << (N <= fixedSystemMax<Space> ? "" : " (above fixedSystemMax)")
+              << "  unrolled " << ns[0] << " ns  solver " << ns[1] << " ns  speedup " << ns[1] / ns[0] << "x\n";
 }
 
-void initLighting() {
-    glEnable(GL_LIGHTING);        // Enable lighting system
-    glEnable(GL_LIGHT0);          // Enable default light
-    glEnable(GL_COLOR_MATERIAL);  // Allow glColor to affect materials
-    glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE); // Material settings
+template <class Space>
+void BenchmarkSmallSystems(const char* space) {
+    BenchmarkSmallSystem<Space, 4>(space);
+    BenchmarkSmallSystem<Space, 8>(space);
+    BenchmarkSmallSystem<Space, 9>(space);
+    BenchmarkSmallSystem<Space, 12>(space);
+    BenchmarkSmallSystem<Space, 16>(space);
+}
 
-    // Set up light position
-    GLfloat light_pos[] = { 0.0f, 500.0f, 500.0f, 1.0f }; // Positional light
-    glLightfv(GL_LIGHT0, GL_POSITION, light_pos);
+// Times both force reductions on n random bodies at several pool sizes and
+// checks that the deterministic result does not depend on the thread count.
+// Then times the unrolled small-system kernel against the solver on a
+// single thread, which is what fixedSystemMax is chosen from.
+int BenchmarkForces(size_t n) {
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<float> coord(-500.0f, 500.0f), massDist(0.1f, 100.0f);
+    std::vector<glm::vec3> pos(n);
+    std::vector<float> mass(n);
+    for (size_t i = 0; i < n; ++i) {
+        pos[i] = glm::vec3(coord(rng), coord(rng), coord(rng));
+        mass[i] = massDist(rng);
+    }
 
-    // Set light properties
-    GLfloat ambient[] = { 0.2f, 0.2f, 0.2f, 1.0f };
-    GLfloat diffuse[] = { 0.8f, 0.8f, 0.8f, 1.0f };
-    glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned> threadCounts = { 1, 8, 64 };
+    if (maxThreads != 1 && maxThreads != 8 && maxThreads != 64) threadCounts.push_back(maxThreads);
+
+    std::vector<glm::vec3> forces(n), reference;
+    bool identical = true;
+    for (unsigned t : threadCounts) {
+        ThreadPool pool(t);
+        double ms[2];
+        for (int mode = 0; mode < 2; ++mode) {
+            GravitySolver<Space3D> solver(pool, mode == 0 ? Reduction::Fast : Reduction::Deterministic);
+            solver.ComputeForces(pos.data(), mass.data(), n, n, forces.data()); // warm up
+            const int reps = 5;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < reps; ++r)
+                solver.ComputeForces(pos.data(), mass.data(), n, n, forces.data());
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            ms[mode] = elapsed.count() / reps;
+        }
+        if (reference.empty())
+            reference = forces;
+        else if (memcmp(reference.data(), forces.data(), n * sizeof(glm::vec3)) != 0)
+            identical = false;
+
+        std::cout << "N=" << n << " threads=" << t
+                  << "  fast " << ms[0] << " ms  deterministic " << ms[1] << " ms"
+                  << "  overhead " << ms[1] / ms[0] << "x\n";
+    }
+    std::cout << "deterministic forces bitwise identical across thread counts: "
+              << (identical ? "yes" : "NO") << "\n";
+    BenchmarkSmallSystems<PlaneXZ>("plane");
+    BenchmarkSmallSystems<Space3D>("3d");
+    return identical ? 0 : 1;
 }
 
-void HyperBoloid_Funnel_WithMass(std::vector<Sphere>& planets, float size, float step) {
-    glPushMatrix();
-    glColor3f(0.9f, 0.9f, 0.9f);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+// Times the spatial index on n random bodies: build and refit, a batch of
+// kNN queries from every body, radius and box queries, and close-encounter
+// pairs. A sample of the queries is checked against brute force.
+int BenchmarkQueries(size_t n, unsigned threads) {
+    std::mt19937 rng(12345);
+    std::uniform_real_distribution<float> coord(-5000.0f, 5000.0f), radiusDist(0.5f, 5.0f);
+    std::vector<glm::vec3> pos(n);
+    std::vector<float> radius(n);
+    for (size_t i = 0; i < n; ++i) {
+        pos[i] = glm::vec3(coord(rng), coord(rng), coord(rng));
+        radius[i] = radiusDist(rng);
+    }
+    ThreadPool pool(threads);
+    auto ms = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    Bvh index;
+    auto start = std::chrono::steady_clock::now();
+    index.Build(pos.data(), radius.data(), n);
+    double buildMs = ms(start);
+    for (glm::vec3& p : pos) p += glm::vec3(coord(rng), coord(rng), coord(rng)) * 1e-3f;
+    start = std::chrono::steady_clock::now();
+    index.Refit(pos.data(), radius.data());
+    double refitMs = ms(start);
+
+    const size_t k = 8;
+    std::vector<Bvh::Neighbor> neighbors(n * k);
+    std::vector<uint32_t> found(n);
+    start = std::chrono::steady_clock::now();
+    index.NearestBatch(pool, pos.data(), n, k, neighbors.data(), found.data());
+    double knnMs = ms(start);
+
+    const float r = 200.0f;
+    std::vector<size_t> perWorker(pool.Size());
+    start = std::chrono::steady_clock::now();
+    index.ForEachWithinBatch(pool, pos.data(), n, r, [&](size_t, uint32_t, float, unsigned w) { ++perWorker[w]; });
+    double radiusMs = ms(start);
+    size_t withinTotal = 0;
+    for (size_t c : perWorker) withinTotal += c;
+
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+    start = std::chrono::steady_clock::now();
+    index.CloseEncounters(pool, 20.0f, pairs);
+    double encounterMs = ms(start);
+
+    // Brute-force check on a sample of query points
+    bool correct = true;
+    std::vector<Bvh::Neighbor> expected(n);
+    for (size_t q = 0; q < std::min<size_t>(n, 50); ++q) {
+        size_t query = (q * 7919) % n;
+        const glm::vec3& p = pos[query];
+        for (size_t i = 0; i < n; ++i) expected[i] = { (uint32_t)i, glm::dot(pos[i] - p, pos[i] - p) };
+        std::partial_sort(expected.begin(), expected.begin() + std::min(k, n), expected.end(),
+                          [](const Bvh::Neighbor& a, const Bvh::Neighbor& b) { return a.dist2 < b.dist2; });
+        correct &= found[query] == std::min(k, n);
+        for (size_t j = 0; j < std::min(k, n); ++j)
+            correct &= neighbors[query * k + j].dist2 == expected[j].dist2;
+
+        size_t within = 0, inBox = 0, expectWithin = 0, expectInBox = 0;
+        glm::vec3 lo = p - glm::vec3(r), hi = p + glm::vec3(r);
+        index.ForEachWithin(p, r, [&](uint32_t, float) { ++within; });
+        index.ForEachInBox(lo, hi, [&](uint32_t) { ++inBox; });
+        for (size_t i = 0; i < n; ++i) {
+            expectWithin += expected[i].dist2 <= r * r;
+            expectInBox += glm::all(glm::greaterThanEqual(pos[i], lo)) && glm::all(glm::lessThanEqual(pos[i], hi));
+        }
+        correct &= within == expectWithin && inBox == expectInBox;
+    }
 
-    for (float x = -size; x < size; x += step) {
-        for (float z = -size; z < size; z += step) {
-            float y00 = 0.0f, y10 = 0.0f, y01 = 0.0f, y11 = 0.0f;
+    std::cout << "N=" << n << " threads=" << pool.Size() << "\n"
+              << "  build " << buildMs << " ms  refit " << refitMs << " ms\n"
+              << "  " << k << "-NN from every body " << knnMs << " ms (" << knnMs * 1e6 / n << " ns/query)\n"
+              << "  radius " << r << " from every body " << radiusMs << " ms, " << withinTotal << " hits\n"
+              << "  close encounters < 20: " << pairs.size() << " pairs in " << encounterMs << " ms\n"
+              << "  sampled queries match brute force: " << (correct ? "yes" : "NO") << "\n";
+    return correct ? 0 : 1;
+}
 
-            for (const auto& p : planets) {
-                float dx0 = x - p.position.x, dz0 = z - p.position.z;
-                float dx1 = x + step - p.position.x, dz1 = z + step - p.position.z;
+// Integrates `systems` copies of the solar system, each with masses and
+// initial velocities perturbed by up to 1%, and reports the throughput.
+template <class Space>
+int RunEnsembleIn(size_t systems, size_t steps, unsigned threads) {
+    constexpr size_t N = 9, S = 1;
+    std::vector<Sphere> base = CreateSolarSystem();
+    // Ensemble systems keep their static bodies last
+    std::stable_partition(base.begin(), base.end(), [](const Sphere& p) { return !p.isStatic; });
+    size_t numStatic = std::count_if(base.begin(), base.end(), [](const Sphere& p) { return p.isStatic; });
+    if (base.size() != N || numStatic != S) {
+        std::cerr << "Ensemble mode expects " << N << " bodies (" << S << " static), scene has "
+                  << base.size() << " (" << numStatic << " static)\n";
+        return 1;
+    }
 
-                float dist00 = dx0*dx0 + dz0*dz0 + 1.0f;
-                float dist10 = dx1*dx1 + dz0*dz0 + 1.0f;
-                float dist01 = dx0*dx0 + dz1*dz1 + 1.0f;
-                float dist11 = dx1*dx1 + dz1*dz1 + 1.0f;
+    Ensemble<N, Space, S> ensemble(systems);
+    std::uniform_real_distribution<float> jitter(0.99f, 1.01f);
+    for (size_t s = 0; s < systems; ++s) {
+        std::mt19937 rng((unsigned)s);
+        for (size_t i = 0; i < N; ++i) {
+            ensemble.SetBody(s, i, Space::FromWorld(base[i].position),
+                             Space::FromWorld(base[i].velocity * jitter(rng)), base[i].mass * jitter(rng));
+        }
+    }
 
-                y00 -= glm::min(p.mass / dist00 * 0.03f, 50.0f);
-                y10 -= glm::min(p.mass / dist10 * 0.03f, 50.0f);
-                y01 -= glm::min(p.mass / dist01 * 0.03f, 50.0f);
-                y11 -= glm::min(p.mass / dist11 * 0.03f, 50.0f);
+    ThreadPool pool(threads);
+    const float dt = 1.0f / 60.0f;
+    auto start = std::chrono::steady_clock::now();
+    ensemble.Integrate(pool, dt, steps);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Spread of the final Sun-Earth distance across the ensemble
+    const size_t earth = 2, sun = N - 1;
+    float nearest = 1e30f, farthest = 0.0f;
+    for (size_t s = 0; s < systems; ++s) {
+        float d = glm::length(ensemble.Position(s, earth) - ensemble.Position(s, sun));
+        nearest = std::min(nearest, d);
+        farthest = std::max(farthest, d);
+    }
 
-            }
+    std::cout << systems << " systems x " << steps << " steps on " << pool.Size() << " threads: "
+              << elapsed.count() << " s, " << systems * steps / elapsed.count() << " system-steps/s\n"
+              << "Sun-Earth distance after " << steps * dt << " time units: " << nearest << " .. " << farthest << "\n";
+    return 0;
+}
 
-            float x0 = x, z0 = z;
-            float x1 = x + step, z1 = z + step;
+int RunEnsemble(size_t systems, size_t steps, unsigned threads, bool space3D) {
+    if (space3D) return RunEnsembleIn<Space3D>(systems, steps, threads);
+    return RunEnsembleIn<PlaneXZ>(systems, steps, threads);
+}
 
-            glBegin(GL_TRIANGLES);
-            glVertex3f(x0, y00, z0);
-            glVertex3f(x1, y10, z0);
-            glVertex3f(x1, y11, z1);
+// Puts a heavy prescribed body on a circle among light dynamic bodies at
+// rest and checks that it stays on its path while they fall towards it,
+// with the acceleration of the first step matching its pull alone.
+template <class Space>
+bool CheckPrescribedIn(size_t dynamicBodies) {
+    ThreadPool pool(2);
+    SpaceSimulation<Space> sim(pool, Reduction::Fast, 0.0f);
+    const float heavy = 1.0e5f, dt = 1.0f / 60.0f;
+    CircularPath path{ glm::vec3(0.0f), 100.0f, 0.5f, 0.3f };
+    std::vector<glm::vec3> start(dynamicBodies);
+    for (size_t i = 0; i < dynamicBodies; ++i) {
+        float a = 2.0f * (float)M_PI * i / dynamicBodies;
+        start[i] = 300.0f * glm::vec3(cosf(a), 0.0f, sinf(a));
+        sim.AddBody(start[i], glm::vec3(0.0f), 1.0f, Motion::Dynamic);
+    }
+    size_t id = sim.IdOf(sim.AddPrescribedBody(path, heavy));
+
+    bool correct = true;
+    float pathError = 0.0f, pullError = 0.0f;
+    SimulationSnapshot snapshot;
+    std::vector<glm::vec3> pos(sim.Size());
+    for (int step = 0; step < 600; ++step) {
+        sim.Step(dt);
+        sim.GetPositions(pos.data());
+        pathError = std::max(pathError, glm::distance(pos[id], path.PositionAt(sim.Time())));
+        if (step > 0) continue;
+        sim.GetSnapshot(snapshot);
+        correct &= glm::distance(snapshot.velocity[id], path.VelocityAt(sim.Time())) < 1e-3f;
+        glm::vec3 source = path.PositionAt(0.0f);
+        for (size_t i = 0; i < dynamicBodies; ++i) {
+            glm::vec3 dir = source - start[i];
+            float dist2 = glm::dot(dir, dir) + softening2;
+            glm::vec3 expected = dir * (gravityG * heavy / (dist2 * std::sqrt(dist2))) * dt;
+            pullError = std::max(pullError, glm::distance(snapshot.velocity[i], expected) / glm::length(expected));
+        }
+    }
+    correct &= pathError < 1e-3f * path.radius && pullError < 0.01f;
+    std::cout << "  " << dynamicBodies << " dynamic bodies: path error " << pathError << ", pull error "
+              << pullError * 100.0f << "%\n";
+    return correct;
+}
 
-            glVertex3f(x0, y00, z0);
-            glVertex3f(x1, y11, z1);
-            glVertex3f(x0, y01, z1);
-            glEnd();
+int CheckPrescribed() {
+    bool correct = true;
+    for (size_t n : { (size_t)1, fixedSystemMax<PlaneXZ> + 8 }) {
+        correct &= CheckPrescribedIn<PlaneXZ>(n);
+        correct &= CheckPrescribedIn<Space3D>(n);
+    }
+    std::cout << "prescribed bodies follow their paths and attract dynamic bodies: " << (correct ? "yes" : "NO")
+              << "\n";
+    return correct ? 0 : 1;
+}
+
+// Moves a Sun-mass body and a swarm of light ones over the funnel for 100
+// frames and compares the incrementally updated surface with a full
+// recompute after every frame. Every body moves further than moveTolerance
+// each frame, so the surface must see all of them; tiles outside a moved
+// body's reach may then be off by up to heightEpsilon per body.
+int CheckFunnel(unsigned threads) {
+    ThreadPool pool(threads);
+    FunnelSurface incremental(500.0f, 15.0f), full(500.0f, 15.0f);
+    full.incremental = false;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> coord(-450.0f, 450.0f), massDist(0.1f, 2000.0f),
+        angle(0.0f, 2.0f * (float)M_PI);
+    std::vector<glm::vec3> pos(40);
+    std::vector<float> mass(pos.size());
+    for (size_t b = 0; b < pos.size(); ++b) {
+        pos[b] = glm::vec3(coord(rng), 0.0f, coord(rng));
+        mass[b] = massDist(rng);
+    }
+    pos[0] = glm::vec3(-100.0f, 0.0f, 0.0f);
+    mass[0] = 1.989e6f;
+
+    float worst = 0.0f;
+    for (int frame = 0; frame < 100; ++frame) {
+        pos[0].x += 2.0f;
+        for (size_t b = 1; b < pos.size(); ++b) {
+            float a = angle(rng);
+            pos[b] += 2.0f * incremental.moveTolerance * glm::vec3(cosf(a), 0.0f, sinf(a));
         }
+        incremental.Compute(pool, pos.data(), mass.data(), pos.size());
+        full.Compute(pool, pos.data(), mass.data(), pos.size());
+        for (int r = 0; r < full.Vertices(); ++r)
+            for (int c = 0; c < full.Vertices(); ++c)
+                worst = std::max(worst, std::abs(incremental.Height(r, c) - full.Height(r, c)));
     }
+    float bound = incremental.heightEpsilon * (float)pos.size();
+    bool correct = worst <= bound;
+    std::cout << "incremental funnel within " << bound << " of a full recompute: " << (correct ? "yes" : "NO")
+              << " (largest difference " << worst << ")\n";
+    return correct ? 0 : 1;
+}
 
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glPopMatrix();
+// Steps both reductions of the solver with more dynamic bodies than the
+// unrolled kernel takes, finds close encounters and updates the funnel in
+// every mode, the work that draws on the scratch arenas, and fails if any
+// of it allocates once the arenas have settled after the warm-up steps.
+int CheckArena(unsigned threads) {
+    const size_t dynamicBodies = fixedSystemMax<Space3D> + 32, warmup = 60, steps = 300;
+    const float dt = 1.0f / 60.0f;
+    ThreadPool pool(threads);
+    std::vector<std::unique_ptr<Simulation>> sims;
+    for (Reduction reduction : { Reduction::Fast, Reduction::Deterministic }) {
+        sims.push_back(std::make_unique<SpaceSimulation<Space3D>>(pool, reduction, 0.0f));
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> radius(100.0f, 450.0f), angle(0.0f, 2.0f * (float)M_PI);
+        sims.back()->AddBody(glm::vec3(0.0f), glm::vec3(0.0f), 1.0e5f, Motion::Static);
+        sims.back()->AddPrescribedBody(CircularPath{ glm::vec3(0.0f), 60.0f, 0.5f, 0.0f }, 1.0e3f);
+        for (size_t b = 0; b < dynamicBodies; ++b) {
+            float r = radius(rng), a = angle(rng), v = std::sqrt(gravityG * 1.0e5f / r);
+            sims.back()->AddBody(r * glm::vec3(cosf(a), 0.0f, sinf(a)), v * glm::vec3(-sinf(a), 0.0f, cosf(a)),
+                                 1.0f + (float)b, Motion::Dynamic);
+        }
+    }
+    size_t n = sims[0]->Size();
+    std::vector<FunnelSurface> funnels(3, FunnelSurface(500.0f, 15.0f));
+    funnels[0].mode = FunnelMode::Direct;
+    funnels[1].mode = FunnelMode::Tree;
+    funnels[2].mode = FunnelMode::Fft;
+    std::vector<glm::vec3> pos(n);
+    std::vector<float> radius(n, 5.0f), mass(n);
+    for (size_t i = 0; i < n; ++i) mass[i] = 1.0f + (float)i;
+    Bvh bvh;
+    std::vector<std::pair<uint32_t, uint32_t>> encounters;
+    encounters.reserve(n * (n - 1) / 2);
+
+    uint64_t allocations = 0;
+    for (size_t step = 0; step < warmup + steps; ++step) {
+        pool.ResetScratch();
+        uint64_t before = ForegroundAllocations();
+        for (auto& sim : sims) sim->Step(dt);
+        sims[0]->GetPositions(pos.data());
+        bvh.Update(pos.data(), radius.data(), n);
+        bvh.CloseEncounters(pool, 40.0f, encounters);
+        for (FunnelSurface& funnel : funnels) funnel.Compute(pool, pos.data(), mass.data(), n);
+        if (step >= warmup) allocations += ForegroundAllocations() - before;
+    }
+    bool correct = allocations == 0;
+    std::cout << "solver, encounter and funnel steps allocate nothing after warm-up: " << (correct ? "yes" : "NO")
+              << " (" << allocations << " allocations in " << steps << " steps)\n";
+    if (!correct) PrintMemoryStats(std::cout);
+    return correct ? 0 : 1;
 }
@@ -0,0 +1,110 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Quadtree over point masses in the x/z plane. Every node keeps the total
+// mass below it and its center of mass, which stand in for all of those
+// bodies when the node is seen from far enough away (Barnes-Hut). Nodes are
+// stored flat, the four children of a node next to each other, and the
+// bodies are copied into leaf order so a leaf is one contiguous range.
+class MassQuadtree {
+public:
+    static constexpr uint32_t leafSize = 8;
+    static constexpr int maxDepth = 24; // bounds the depth for coincident bodies
+
+    struct Node {
+        float cx, cz;     // center of mass
+        float mass;
+        float size;       // edge length of the node's square
+        uint32_t child;   // index of the first of four children, 0 for leaves
+        uint32_t first, count;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<float> x, z, mass; // bodies in leaf order
+
+    void Build(const float* bx, const float* bz, const float* bm, size_t n) {
+        nodes.clear();
+        order.resize(n);
+        for (size_t i = 0; i < n; ++i) order[i] = (uint32_t)i;
+        srcX = bx;
+        srcZ = bz;
+        if (n == 0) return;
+
+        float loX = bx[0], hiX = bx[0], loZ = bz[0], hiZ = bz[0];
+        for (size_t i = 1; i < n; ++i) {
+            loX = std::min(loX, bx[i]);
+            hiX = std::max(hiX, bx[i]);
+            loZ = std::min(loZ, bz[i]);
+            hiZ = std::max(hiZ, bz[i]);
+        }
+        float size = std::max(std::max(hiX - loX, hiZ - loZ), 1e-3f);
+        nodes.push_back({});
+        BuildNode(0, 0.5f * (loX + hiX), 0.5f * (loZ + hiZ), size, 0, (uint32_t)n, 0);
+
+        x.resize(n);
+        z.resize(n);
+        mass.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            x[i] = bx[order[i]];
+            z[i] = bz[order[i]];
+            mass[i] = bm[order[i]];
+        }
+        for (Node& node : nodes) {
+            if (node.count == 0) continue;
+            if (node.child == 0) {
+                float m = 0, mx = 0, mz = 0;
+                for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                    m += mass[i];
+                    mx += mass[i] * x[i];
+                    mz += mass[i] * z[i];
+                }
+                node.mass = m;
+                node.cx = m > 0 ? mx / m : x[node.first];
+                node.cz = m > 0 ? mz / m : z[node.first];
+            }
+        }
+        // Children come after their parent, so a reverse sweep sees them first
+        for (size_t k = nodes.size(); k-- > 0;) {
+            Node& node = nodes[k];
+            if (node.child == 0 || node.count == 0) continue;
+            float m = 0, mx = 0, mz = 0;
+            for (uint32_t c = node.child; c < node.child + 4; ++c) {
+                m += nodes[c].mass;
+                mx += nodes[c].mass * nodes[c].cx;
+                mz += nodes[c].mass * nodes[c].cz;
+            }
+            node.mass = m;
+            node.cx = m > 0 ? mx / m : nodes[node.child].cx;
+            node.cz = m > 0 ? mz / m : nodes[node.child].cz;
+        }
+    }
+
+private:
+    void BuildNode(uint32_t index, float ox, float oz, float size, uint32_t first, uint32_t count, int depth) {
+        nodes[index] = { ox, oz, 0.0f, size, 0, first, count };
+        if (count <= leafSize || depth == maxDepth) return;
+
+        auto begin = order.begin() + first, end = begin + count;
+        auto midZ = std::partition(begin, end, [&](uint32_t b) { return srcZ[b] < oz; });
+        auto midLo = std::partition(begin, midZ, [&](uint32_t b) { return srcX[b] < ox; });
+        auto midHi = std::partition(midZ, end, [&](uint32_t b) { return srcX[b] < ox; });
+        uint32_t bounds[5] = { first, (uint32_t)(midLo - order.begin()), (uint32_t)(midZ - order.begin()),
+                               (uint32_t)(midHi - order.begin()), first + count };
+
+        uint32_t child = (uint32_t)nodes.size();
+        nodes[index].child = child;
+        nodes.resize(nodes.size() + 4);
+        float q = 0.25f * size;
+        for (int c = 0; c < 4; ++c) {
+            float cx = ox + ((c & 1) ? q : -q), cz = oz + ((c & 2) ? q : -q);
+            BuildNode(child + c, cx, cz, 0.5f * size, bounds[c], bounds[c + 1] - bounds[c], depth + 1);
+        }
+    }
+
+    std::vector<uint32_t> order;
+    const float* srcX = nullptr;
+    const float* srcZ = nullptr;
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// What a thread is doing when it allocates. Each thread has a current phase,
+// set with MemoryPhaseScope; pool workers take on the phase of the thread
+// that called Run(). Threads that run beside the frame loop (trajectory
+// prediction, frame writing) stay in Background for their whole life.
+// Threads the program did not start, in practice the GL driver's, never set
+// a phase and count as Driver; main.cpp moves the main thread to Other.
+// Calls into the driver that can compile shader variants (draws, clears,
+// blits, readback, buffer swaps) are wrapped in a DriverCallScope, since a
+// software rasterizer like llvmpipe JIT-compiles them on the calling
+// thread through the program's operator new.
+enum class MemoryPhase : uint8_t {
+    Other,
+    Force,
+    Integrate,
+    Render,
+    Io,
+    Background,
+    Driver,
+    Count
+};
+
+inline const char* MemoryPhaseName(MemoryPhase phase) {
+    static const char* const names[] = { "other", "force", "integrate", "render", "io", "background", "driver" };
+    return names[(size_t)phase];
+}
+
+struct MemoryCounters {
+    std::atomic<uint64_t> allocations;
+    std::atomic<uint64_t> frees;
+    std::atomic<int64_t> bytes; // live bytes allocated in this phase
+    std::atomic<int64_t> peak;
+};
+
+// Filled in by the global operator new/delete in main.cpp; frees are charged
+// to the phase that made the allocation.
+inline MemoryCounters* MemoryStats() {
+    static MemoryCounters counters[(size_t)MemoryPhase::Count];
+    return counters;
+}
+
+inline MemoryPhase& CurrentMemoryPhase() {
+    static thread_local MemoryPhase phase = MemoryPhase::Driver;
+    return phase;
+}
+
+// The same counters per profiler scope (Profiler::CurrentScope()), for a
+// breakdown by subsystem. Scopes are told apart by name pointer, like the
+// profiler does, and take the first free slot of a fixed open-addressed
+// table. Slot 0 holds allocations made outside any scope, or while the
+// profiler is off, and those of scopes that found the table full.
+constexpr size_t memoryScopeSlots = 64;
+
+struct MemoryScopeCounters {
+    std::atomic<const char*> name;
+    MemoryCounters counters;
+};
+
+inline MemoryScopeCounters* MemoryScopeStats() {
+    static MemoryScopeCounters scopes[memoryScopeSlots];
+    return scopes;
+}
+
+inline uint16_t MemoryScopeSlot(const char* name) {
+    if (!name) return 0;
+    MemoryScopeCounters* scopes = MemoryScopeStats();
+    size_t start = ((uintptr_t)name >> 4) % (memoryScopeSlots - 1);
+    for (size_t k = 0; k < memoryScopeSlots - 1; ++k) {
+        size_t slot = 1 + (start + k) % (memoryScopeSlots - 1);
+        const char* held = scopes[slot].name.load(std::memory_order_acquire);
+        if (!held && scopes[slot].name.compare_exchange_strong(held, name, std::memory_order_acq_rel)) held = name;
+        if (held == name) return (uint16_t)slot;
+    }
+    return 0;
+}
+
+class MemoryPhaseScope {
+public:
+    explicit MemoryPhaseScope(MemoryPhase phase) : previous(CurrentMemoryPhase()) { CurrentMemoryPhase() = phase; }
+    ~MemoryPhaseScope() { CurrentMemoryPhase() = previous; }
+
+    MemoryPhaseScope(const MemoryPhaseScope&) = delete;
+    MemoryPhaseScope& operator=(const MemoryPhaseScope&) = delete;
+
+private:
+    MemoryPhase previous;
+};
+
+inline void CountAllocation(MemoryCounters& c, size_t bytes) {
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    int64_t now = c.bytes.fetch_add((int64_t)bytes, std::memory_order_relaxed) + (int64_t)bytes;
+    int64_t peak = c.peak.load(std::memory_order_relaxed);
+    while (now > peak && !c.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {}
+}
+
+inline void CountFree(MemoryCounters& c, size_t bytes) {
+    c.frees.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_sub((int64_t)bytes, std::memory_order_relaxed);
+}
+
+inline void RecordAllocation(MemoryPhase phase, uint16_t scope, size_t bytes) {
+    CountAllocation(MemoryStats()[(size_t)phase], bytes);
+    CountAllocation(MemoryScopeStats()[scope].counters, bytes);
+}
+
+inline void RecordFree(MemoryPhase phase, uint16_t scope, size_t bytes) {
+    CountFree(MemoryStats()[(size_t)phase], bytes);
+    CountFree(MemoryScopeStats()[scope].counters, bytes);
+}
+
+// Charges what the GL driver allocates inside a call to Driver.
+class DriverCallScope : public MemoryPhaseScope {
+public:
+    DriverCallScope() : MemoryPhaseScope(MemoryPhase::Driver) {}
+};
+
+// Allocations so far by everything but Background threads and the Driver
+// phase, neither of which the program's own frame loop code controls.
+inline uint64_t ForegroundAllocations() {
+    uint64_t total = 0;
+    for (size_t p = 0; p < (size_t)MemoryPhase::Count; ++p)
+        if ((MemoryPhase)p != MemoryPhase::Background && (MemoryPhase)p != MemoryPhase::Driver)
+            total += MemoryStats()[p].allocations.load();
+    return total;
+}
+
+inline void PrintMemoryCounters(std::ostream& out, const char* name, const MemoryCounters& c) {
+    out << std::left << std::setw(16) << name << std::right << std::setw(12) << c.allocations.load() << std::setw(12)
+        << c.frees.load() << std::setw(14) << c.bytes.load() / 1024 << std::setw(12) << c.peak.load() / 1024 << "\n";
+}
+
+// One table by phase, then one by profiler scope for the scopes that
+// allocated at all.
+inline void PrintMemoryStats(std::ostream& out) {
+    out << std::left << std::setw(16) << "phase" << std::right << std::setw(12) << "allocs" << std::setw(12)
+        << "frees" << std::setw(14) << "current KiB" << std::setw(12) << "peak KiB" << "\n";
+    for (size_t p = 0; p < (size_t)MemoryPhase::Count; ++p)
+        PrintMemoryCounters(out, MemoryPhaseName((MemoryPhase)p), MemoryStats()[p]);
+    out << std::left << std::setw(16) << "scope" << std::right << std::setw(12) << "allocs" << std::setw(12)
+        << "frees" << std::setw(14) << "current KiB" << std::setw(12) << "peak KiB" << "\n";
+    for (size_t s = 0; s < memoryScopeSlots; ++s) {
+        const MemoryScopeCounters& scope = MemoryScopeStats()[s];
+        const char* name = s == 0 ? "(none)" : scope.name.load();
+        if (name && scope.counters.allocations.load() > 0) PrintMemoryCounters(out, name, scope.counters);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <iostream>
+#include <glad/glad.h>
+#include "memory_stats.h"
+
+// Framebuffer object with an RGBA8 color and a 24-bit depth renderbuffer.
+// Frames that are recorded are drawn here, so recording works the same with
+// a visible window, a hidden one, or a context that has no default
+// framebuffer at all (EGL surfaceless, OSMesa).
+class OffscreenTarget {
+public:
+    bool Init(int w, int h) {
+        width = w;
+        height = h;
+        glGenFramebuffers(1, &fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glGenRenderbuffers(2, renderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Offscreen framebuffer incomplete: 0x" << std::hex << status << std::dec << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Directs drawing and glReadPixels at this target.
+    void Bind() const { glBindFramebuffer(GL_FRAMEBUFFER, fbo); }
+
+    // Copies the frame to the window's back buffer and leaves it bound.
+    void BlitToWindow() const {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        DriverCallScope driver;
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+private:
+    GLuint fbo = 0;
+    GLuint renderbuffers[2] = {};
+    int width = 0, height = 0;
+};
@@ -0,0 +1,205 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "memory_stats.h"
+
+// Attribute locations of the trail shader.
+constexpr GLuint trailPositionLoc = 0;
+constexpr GLuint trailColorLoc = 1;
+
+// The last `length` sampled positions of every body, drawn as fading line
+// strips.
+//
+// On the CPU each body owns a ring of `length` slots stored as separate x, y
+// and z arrays; all rings share one write head, since every body is sampled
+// at once. The GPU copy is laid out slot-major, so one sample of all bodies
+// is a single contiguous range and each append is one glBufferSubData of
+// `bodies` vertices. A static index buffer walks each body's slots in order
+// with slot 0 repeated at the end; drawing [head, length] and then
+// [0, head) follows the trail from oldest to newest through the wrap without
+// joining the newest point back to the oldest. Storage is sized once, so
+// neither appending nor drawing allocates. Removing a body changes the
+// layout and re-uploads everything, but through preallocated staging
+// storage and glBufferSubData into buffers that already fit, so that does
+// not allocate either; the buffers are only re-created if the body count
+// grows past what they were made for.
+class OrbitTrails {
+public:
+    float sampleInterval = 0.05f; // seconds of simulated time between samples
+
+    OrbitTrails(size_t bodies, size_t length)
+        : bodies(bodies), length(length), x(bodies * length), y(bodies * length), z(bodies * length),
+          staging(bodies), counts(2 * bodies), offsets(2 * bodies), upload(bodies * length),
+          indices(bodies * (length + 1)) {}
+
+    void Init(GLuint program, const glm::vec3* colors) {
+        shader = program;
+        newestLoc = glGetUniformLocation(program, "newest");
+        bodiesLoc = glGetUniformLocation(program, "bodies");
+        lengthLoc = glGetUniformLocation(program, "length");
+
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(trailPositionLoc);
+        glVertexAttribPointer(trailPositionLoc, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        glGenBuffers(1, &colorVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, colorVbo);
+        glEnableVertexAttribArray(trailColorLoc);
+        glVertexAttribPointer(trailColorLoc, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        glGenBuffers(1, &ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        UploadAll(colors);
+    }
+
+    // Drops a body's trail the way arrays indexed by body are swap-removed:
+    // the last body's trail moves into its place. The GPU layout depends on
+    // the body count, so all buffers are re-uploaded; colors are the
+    // remaining bodies' colors.
+    void RemoveBody(size_t body, const glm::vec3* colors) {
+        size_t last = bodies - 1;
+        if (body != last) {
+            std::copy_n(x.begin() + last * length, length, x.begin() + body * length);
+            std::copy_n(y.begin() + last * length, length, y.begin() + body * length);
+            std::copy_n(z.begin() + last * length, length, z.begin() + body * length);
+        }
+        bodies = last;
+        x.resize(bodies * length);
+        y.resize(bodies * length);
+        z.resize(bodies * length);
+        staging.resize(bodies);
+        counts.resize(2 * bodies);
+        offsets.resize(2 * bodies);
+        UploadAll(colors);
+    }
+
+    // Advances simulated time and records every body's position once a
+    // sample interval has passed. Takes at most one sample per call, which
+    // the next Draw uploads.
+    void Update(const glm::vec3* pos, float dt) {
+        elapsed += dt;
+        if (count > 0 && elapsed < sampleInterval) return;
+        elapsed = count > 0 ? elapsed - sampleInterval : 0.0f;
+        if (elapsed > sampleInterval) elapsed = 0.0f; // don't try to catch up after a stall
+        for (size_t b = 0; b < bodies; ++b) {
+            x[b * length + head] = pos[b].x;
+            y[b * length + head] = pos[b].y;
+            z[b * length + head] = pos[b].z;
+            staging[b] = pos[b];
+        }
+        pending = head;
+        head = (head + 1) % length;
+        if (count < length) ++count;
+    }
+
+    // Position of a body `age` samples ago, age < Samples().
+    glm::vec3 Sample(size_t body, size_t age) const {
+        size_t slot = (head + length - 1 - age) % length;
+        size_t i = body * length + slot;
+        return glm::vec3(x[i], y[i], z[i]);
+    }
+
+    size_t Samples() const { return count; }
+
+    void Draw() {
+        if (pending != noSample) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            glBufferSubData(GL_ARRAY_BUFFER, pending * bodies * sizeof(glm::vec3), bodies * sizeof(glm::vec3),
+                            staging.data());
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            pending = noSample;
+        }
+        if (count < 2) return;
+
+        // Oldest to newest: [head, length) plus the repeated slot 0 when the
+        // trail wraps, then [0, head). Before the ring fills it is [0, count).
+        size_t first = count < length ? 0 : head;
+        size_t firstCount = count < length ? count : length - head + (head > 0 ? 1 : 0);
+        size_t secondCount = count < length ? 0 : head;
+        GLsizei draws = 0;
+        for (size_t b = 0; b < bodies; ++b) {
+            size_t base = b * (length + 1);
+            counts[draws] = (GLsizei)firstCount;
+            offsets[draws++] = (const void*)((base + first) * sizeof(GLuint));
+            if (secondCount > 1) {
+                counts[draws] = (GLsizei)secondCount;
+                offsets[draws++] = (const void*)(base * sizeof(GLuint));
+            }
+        }
+
+        glUseProgram(shader);
+        glUniform1i(newestLoc, (GLint)((head + length - 1) % length));
+        glUniform1i(bodiesLoc, (GLint)bodies);
+        glUniform1i(lengthLoc, (GLint)length);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glDepthMask(GL_FALSE);
+        glBindVertexArray(vao);
+        {
+            DriverCallScope driver;
+            glMultiDrawElements(GL_LINE_STRIP, counts.data(), GL_UNSIGNED_INT, offsets.data(), draws);
+        }
+        glBindVertexArray(0);
+        glDepthMask(GL_TRUE);
+        glDisable(GL_BLEND);
+        glUseProgram(0);
+    }
+
+private:
+    static constexpr size_t noSample = (size_t)-1;
+
+    // Rewrites the whole GPU copy for the current body count. upload holds
+    // the positions and then the colors in turn.
+    void UploadAll(const glm::vec3* colors) {
+        size_t vertices = bodies * length;
+        bool grow = bodies > capacity;
+        if (grow) {
+            capacity = bodies;
+            upload.resize(vertices);
+            indices.resize(bodies * (length + 1));
+        }
+        for (size_t b = 0; b < bodies; ++b)
+            for (size_t s = 0; s <= length; ++s) indices[b * (length + 1) + s] = (GLuint)((s % length) * bodies + b);
+
+        glBindVertexArray(vao);
+        for (int pass = 0; pass < 2; ++pass) {
+            for (size_t s = 0; s < length; ++s) {
+                for (size_t b = 0; b < bodies; ++b) {
+                    size_t i = b * length + s;
+                    upload[s * bodies + b] = pass == 0 ? glm::vec3(x[i], y[i], z[i]) : colors[b];
+                }
+            }
+            glBindBuffer(GL_ARRAY_BUFFER, pass == 0 ? vbo : colorVbo);
+            if (grow)
+                glBufferData(GL_ARRAY_BUFFER, capacity * length * sizeof(glm::vec3), nullptr,
+                             pass == 0 ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, vertices * sizeof(glm::vec3), upload.data());
+        }
+        if (grow)
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, capacity * (length + 1) * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, bodies * (length + 1) * sizeof(GLuint), indices.data());
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        pending = noSample;
+    }
+
+    size_t bodies, length;
+    size_t capacity = 0;               // bodies the GPU buffers were created for
+    size_t head = 0, count = 0, pending = noSample;
+    float elapsed = 0.0f;
+    std::vector<float> x, y, z;        // [body * length + slot]
+    std::vector<glm::vec3> staging;    // newest sample, slot-major for upload
+    std::vector<GLsizei> counts;
+    std::vector<const void*> offsets;
+    std::vector<glm::vec3> upload;     // staging for UploadAll, slot-major
+    std::vector<GLuint> indices;
+    GLuint shader = 0;
+    GLint newestLoc = -1, bodiesLoc = -1, lengthLoc = -1;
+    GLuint vao = 0, vbo = 0, colorVbo = 0, ibo = 0;
+};
@@ -0,0 +1,175 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "memory_stats.h"
+#include "sphere_mesh.h"
+
+// Per-body data the sphere shader needs, one entry per instance.
+struct SphereInstance {
+    glm::vec4 centerRadius; // xyz = center, w = radius
+    glm::vec3 color;
+};
+
+// Tessellation used once a sphere covers at least minPixels of radius on
+// screen. Highest detail first; anything below the last level is a point.
+struct SphereLod {
+    float minPixels;
+    int slices, stacks;
+};
+
+constexpr SphereLod sphereLods[] = {
+    { 60.0f, 32, 32 },
+    { 20.0f, 20, 20 },
+    {  8.0f, 12, 12 },
+    {  3.0f,  8,  6 },
+    {  1.0f,  5,  4 },
+};
+constexpr int numSphereLods = sizeof(sphereLods) / sizeof(sphereLods[0]);
+
+// Attribute locations of the sphere shader: the unit-sphere vertex comes
+// from the mesh, the other two advance once per instance.
+constexpr GLuint sphereVertexLoc = 0;
+constexpr GLuint sphereInstanceLoc = 1; // vec4 center and radius
+constexpr GLuint sphereColorLoc = 2;    // vec3 color
+
+// Draws any number of spheres with one instanced draw call per detail level.
+// Instance data is streamed each frame into a buffer that is orphaned on
+// map, so the driver never waits for the previous frame's draw to finish
+// reading it. As in ImpostorRenderer, the visible bodies are gathered
+// straight from the simulation's positions and the appearance kept by
+// SetAppearance() into the mapped buffer, with no intermediate copy.
+// Instances are grouped by level on upload, so each level is a
+// contiguous range of the buffer, selected by offsetting the instance
+// attribute pointers in the level's vertex array object. Every level's
+// mesh is built in Init(), so drawing never creates one.
+class PlanetRenderer {
+public:
+    void Init(GLuint program) {
+        shader = program;
+        glGenBuffers(1, &buffer);
+        for (int l = 0; l < numSphereLods; ++l) lodMeshes[l] = BuildSphereMesh(sphereLods[l].slices, sphereLods[l].stacks);
+
+        // Sub-pixel bodies: one vertex on the sphere surface facing +z, so it
+        // picks up the same lighting as the meshes.
+        const float pointVertex[3] = { 0.0f, 0.0f, 1.0f };
+        const GLuint pointIndex = 0;
+        glGenVertexArrays(1, &pointMesh.vao);
+        glBindVertexArray(pointMesh.vao);
+        glGenBuffers(1, &pointMesh.vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, pointMesh.vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(pointVertex), pointVertex, GL_STATIC_DRAW);
+        glGenBuffers(1, &pointMesh.ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pointMesh.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(pointIndex), &pointIndex, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(sphereVertexLoc);
+        glVertexAttribPointer(sphereVertexLoc, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        pointMesh.indexCount = 1;
+    }
+
+    // Sizes the per-frame storage for up to bodies instances, so Draw()
+    // does not allocate for them later.
+    void Reserve(size_t bodies) {
+        level.reserve(bodies);
+        if (bodies > capacity) {
+            capacity = bodies;
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(SphereInstance), nullptr, GL_STREAM_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+    }
+
+    // focalPixels is the viewport height over 2 tan(fovY / 2): a unit length
+    // at distance d covers focalPixels / d pixels.
+    void SetCamera(const glm::vec3& eye, float focalPixels) {
+        camEye = eye;
+        focal = focalPixels;
+    }
+
+    // Color in xyz, radius in w, one per body in the same order as the
+    // positions passed to Draw().
+    void SetAppearance(const glm::vec4* appearance, size_t n) { this->appearance.assign(appearance, appearance + n); }
+
+    // Draws the bodies listed in visible, indices into positions.
+    void Draw(const glm::vec3* positions, size_t n, const uint32_t* visible, size_t count) {
+        if (n > appearance.size()) n = appearance.size();
+
+        // Pick a level per body from its projected radius
+        size_t counts[numSphereLods + 1] = {};
+        level.resize(count);
+        size_t drawn = 0;
+        for (size_t k = 0; k < count; ++k) {
+            if (visible[k] >= n) continue;
+            float radius = appearance[visible[k]].w;
+            float dist = glm::length(positions[visible[k]] - camEye);
+            float pixels = dist > radius ? radius * focal / dist : sphereLods[0].minPixels;
+            int l = 0;
+            while (l < numSphereLods && pixels < sphereLods[l].minPixels) ++l;
+            level[k] = (unsigned char)l;
+            ++counts[l];
+            ++drawn;
+        }
+        if (drawn == 0) return;
+        size_t first[numSphereLods + 2] = {};
+        for (int l = 0; l <= numSphereLods; ++l) first[l + 1] = first[l] + counts[l];
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (drawn > capacity) {
+            capacity = drawn + drawn / 2;
+            glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(SphereInstance), nullptr, GL_STREAM_DRAW);
+        }
+        void* ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, drawn * sizeof(SphereInstance),
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        SphereInstance* out = static_cast<SphereInstance*>(ptr);
+        size_t next[numSphereLods + 1];
+        for (int l = 0; l <= numSphereLods; ++l) next[l] = first[l];
+        for (size_t k = 0; k < count; ++k) {
+            if (visible[k] >= n) continue;
+            const glm::vec4& a = appearance[visible[k]];
+            out[next[level[k]]++] = { glm::vec4(positions[visible[k]], a.w), glm::vec3(a) };
+        }
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+
+        glUseProgram(shader);
+        for (int l = 0; l <= numSphereLods; ++l) {
+            if (counts[l] == 0) continue;
+            bool points = l == numSphereLods;
+            const SphereMesh& mesh = points ? pointMesh : lodMeshes[l];
+            DrawRange(mesh, points ? GL_POINTS : GL_TRIANGLES, first[l], counts[l]);
+        }
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glUseProgram(0);
+    }
+
+private:
+    void DrawRange(const SphereMesh& mesh, GLenum mode, size_t first, size_t count) {
+        glBindVertexArray(mesh.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        size_t base = first * sizeof(SphereInstance);
+        glEnableVertexAttribArray(sphereInstanceLoc);
+        glEnableVertexAttribArray(sphereColorLoc);
+        glVertexAttribPointer(sphereInstanceLoc, 4, GL_FLOAT, GL_FALSE, sizeof(SphereInstance),
+                              (void*)(base + offsetof(SphereInstance, centerRadius)));
+        glVertexAttribPointer(sphereColorLoc, 3, GL_FLOAT, GL_FALSE, sizeof(SphereInstance),
+                              (void*)(base + offsetof(SphereInstance, color)));
+        glVertexAttribDivisor(sphereInstanceLoc, 1);
+        glVertexAttribDivisor(sphereColorLoc, 1);
+        DriverCallScope driver;
+        glDrawElementsInstanced(mode, mesh.indexCount, GL_UNSIGNED_INT, nullptr, (GLsizei)count);
+    }
+
+    GLuint shader = 0;
+    GLuint buffer = 0;
+    size_t capacity = 0;
+    SphereMesh lodMeshes[numSphereLods];
+    SphereMesh pointMesh;
+    glm::vec3 camEye = glm::vec3(0.0f);
+    float focal = 1.0f;
+    std::vector<glm::vec4> appearance;
+    std::vector<unsigned char> level; // per entry of visible
+};
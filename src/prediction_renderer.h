@@ -0,0 +1,62 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "memory_stats.h"
+#include "trajectory_predictor.h"
+
+// Draws predicted paths as line strips in each body's color. A prediction
+// starts at the time of its snapshot; the part the simulation has already
+// passed is skipped, so a path stays attached to its body while the next
+// prediction is being computed.
+class PredictionRenderer {
+public:
+    // program is a flat-color line shader with its color uniform at colorLoc;
+    // vertices are at attribute location 0.
+    void Init(GLuint program, GLint colorLoc) {
+        shader = program;
+        colorUniform = colorLoc;
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void Upload(const Prediction& prediction) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, prediction.samples.size() * sizeof(glm::vec3), prediction.samples.data(),
+                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // colors holds one color per body id.
+    void Draw(const Prediction& prediction, float time, const glm::vec3* colors) {
+        size_t n = prediction.samplesPerBody;
+        if (prediction.bodies.empty() || n < 2) return;
+        float elapsed = (time - prediction.startTime) / prediction.sampleInterval;
+        size_t skip = (size_t)std::max(0.0f, std::floor(elapsed));
+        if (skip + 2 > n) return;
+
+        glUseProgram(shader);
+        glBindVertexArray(vao);
+        for (size_t b = 0; b < prediction.bodies.size(); ++b) {
+            glm::vec3 c = colors[prediction.bodies[b]];
+            glUniform3f(colorUniform, c.r, c.g, c.b);
+            DriverCallScope driver;
+            glDrawArrays(GL_LINE_STRIP, (GLint)(b * n + skip), (GLsizei)(n - skip));
+        }
+        glBindVertexArray(0);
+        glUseProgram(0);
+    }
+
+private:
+    GLuint shader = 0;
+    GLint colorUniform = -1;
+    GLuint vao = 0, vbo = 0;
+};
@@ -0,0 +1,203 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "body_handles.h"
+#include "body_store.h"
+#include "fixed_system.h"
+#include "gravity.h"
+#include "memory_stats.h"
+#include "profiler.h"
+#include "space.h"
+#include "thread_pool.h"
+
+// Steps a store with exactly N dynamic bodies with the unrolled FixedSystem
+// kernel; the remaining static and prescribed bodies enter as sources.
+template <size_t N, class Space>
+void StepFixed(BodyStore<Space>& bodies, float dt) {
+    FixedSystem<N, Space> sys;
+    for (size_t i = 0; i < N; ++i) {
+        sys.position[i] = bodies.position[i];
+        sys.velocity[i] = bodies.velocity[i];
+        sys.mass[i] = bodies.mass[i];
+    }
+    sys.Step(dt, bodies.position.data() + N, bodies.mass.data() + N, bodies.Size() - N);
+    for (size_t i = 0; i < N; ++i) {
+        bodies.position[i] = sys.position[i];
+        bodies.velocity[i] = sys.velocity[i];
+    }
+}
+
+template <class Space>
+using FixedStepFn = void (*)(BodyStore<Space>&, float);
+
+template <class Space, size_t... N>
+constexpr std::array<FixedStepFn<Space>, sizeof...(N)> MakeFixedSteppers(std::index_sequence<N...>) {
+    return { &StepFixed<N, Space>... };
+}
+
+// World-space copy of every body by id, for work that runs beside the
+// simulation on its own thread.
+struct SimulationSnapshot {
+    std::vector<glm::vec3> position;
+    std::vector<glm::vec3> velocity;
+    std::vector<float> mass;
+    std::vector<Motion> motion;
+    std::vector<std::pair<size_t, CircularPath>> paths; // prescribed bodies by id
+    float time = 0.0f;
+
+    void Reserve(size_t bodies) {
+        position.reserve(bodies);
+        velocity.reserve(bodies);
+        mass.reserve(bodies);
+        motion.reserve(bodies);
+        paths.reserve(bodies);
+    }
+};
+
+// Runtime handle on a simulation whose space is chosen at compile time.
+class Simulation {
+public:
+    virtual ~Simulation() = default;
+
+    virtual size_t Size() const = 0;
+
+    // A body's id is its index in GetPositions(); ids are dense, so removing
+    // a body gives the highest id to the body that took the removed one's
+    // place, as a swap-remove would. Handles stay valid across that.
+    virtual BodyHandle AddBody(const glm::vec3& pos, const glm::vec3& vel, float mass,
+                               Motion motion = Motion::Dynamic) = 0;
+    virtual BodyHandle AddPrescribedBody(const CircularPath& path, float mass) = 0;
+
+    // Both return false for stale handles.
+    virtual bool RemoveBody(BodyHandle body) = 0;
+    // Folds absorbed into body, conserving mass and momentum (only mass if
+    // body does not move freely), then removes absorbed.
+    virtual bool MergeBodies(BodyHandle body, BodyHandle absorbed) = 0;
+
+    // Id of a live body, or BodyHandles::npos.
+    virtual size_t IdOf(BodyHandle body) const = 0;
+    virtual BodyHandle HandleOf(size_t id) const = 0;
+
+    virtual void Step(float dt) = 0;
+
+    // World-space position of every body by id; out must hold Size() entries.
+    virtual void GetPositions(glm::vec3* out) const = 0;
+
+    // Fills out with the current state, reusing its storage.
+    virtual void GetSnapshot(SimulationSnapshot& out) const = 0;
+
+    virtual float Time() const = 0;
+};
+
+template <class Space>
+class SpaceSimulation : public Simulation {
+public:
+    using Vec = typename Space::Vec;
+
+    // planeY is the height of the plane for PlaneXZ and unused in 3D.
+    SpaceSimulation(ThreadPool& pool, Reduction reduction, float planeY)
+        : solver(pool, reduction), planeY(planeY) {}
+
+    size_t Size() const override { return bodies.Size(); }
+
+    BodyHandle AddBody(const glm::vec3& pos, const glm::vec3& vel, float mass, Motion motion) override {
+        bodies.Add(Space::FromWorld(pos), Space::FromWorld(vel), mass, motion);
+        return handles.Add();
+    }
+
+    BodyHandle AddPrescribedBody(const CircularPath& path, float mass) override {
+        bodies.AddPrescribed(path, mass);
+        return handles.Add();
+    }
+
+    bool RemoveBody(BodyHandle body) override {
+        size_t id = handles.Id(body);
+        if (id == BodyHandles::npos) return false;
+        bodies.Remove(id);
+        handles.Remove(id);
+        return true;
+    }
+
+    bool MergeBodies(BodyHandle body, BodyHandle absorbed) override {
+        size_t id = handles.Id(body), other = handles.Id(absorbed);
+        if (id == BodyHandles::npos || other == BodyHandles::npos || id == other) return false;
+        size_t s = bodies.slot[id], o = bodies.slot[other];
+        float m = bodies.mass[s], mo = bodies.mass[o], total = m + mo;
+        if (s < bodies.numDynamic) {
+            bodies.position[s] = (bodies.position[s] * m + bodies.position[o] * mo) / total;
+            bodies.velocity[s] = (bodies.velocity[s] * m + bodies.velocity[o] * mo) / total;
+        }
+        bodies.mass[s] = total;
+        bodies.Remove(other);
+        handles.Remove(other);
+        return true;
+    }
+
+    size_t IdOf(BodyHandle body) const override { return handles.Id(body); }
+    BodyHandle HandleOf(size_t id) const override { return handles.Handle(id); }
+
+    // Systems of up to fixedSystemMax dynamic bodies use the unrolled kernel
+    // for their exact size; larger ones go through the solver.
+    void Step(float dt) override {
+        static const std::array<FixedStepFn<Space>, fixedSystemMax<Space> + 1> fixedSteppers =
+            MakeFixedSteppers<Space>(std::make_index_sequence<fixedSystemMax<Space> + 1>{});
+
+        size_t n = bodies.Size(), receivers = bodies.numDynamic;
+        if (receivers <= fixedSystemMax<Space>) {
+            MemoryPhaseScope phase(MemoryPhase::Force); // forces and integration in one kernel
+            ProfileScope profile("fixed step");
+            fixedSteppers[receivers](bodies, dt);
+        } else {
+            {
+                MemoryPhaseScope phase(MemoryPhase::Force);
+                ProfileScope profile("force");
+                forces.resize(receivers);
+                solver.ComputeForces(bodies.position.data(), bodies.mass.data(), n, receivers, forces.data());
+            }
+            MemoryPhaseScope phase(MemoryPhase::Integrate);
+            ProfileScope profile("integrate");
+            bodies.Integrate(forces.data(), dt);
+        }
+        MemoryPhaseScope phase(MemoryPhase::Integrate);
+        bodies.AdvanceTime(dt);
+    }
+
+    void GetPositions(glm::vec3* out) const override {
+        for (size_t i = 0; i < bodies.Size(); ++i)
+            out[bodies.id[i]] = Space::ToWorld(bodies.position[i], planeY);
+    }
+
+    void GetSnapshot(SimulationSnapshot& out) const override {
+        size_t n = bodies.Size();
+        out.position.resize(n);
+        out.velocity.resize(n);
+        out.mass.resize(n);
+        out.motion.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            size_t id = bodies.id[i];
+            out.position[id] = Space::ToWorld(bodies.position[i], planeY);
+            out.velocity[id] = Space::ToWorld(bodies.velocity[i], 0.0f);
+            out.mass[id] = bodies.mass[i];
+            out.motion[id] = i < bodies.numDynamic ? Motion::Dynamic : Motion::Static;
+        }
+        out.paths.clear();
+        for (const auto& b : bodies.paths) {
+            out.motion[b.id] = Motion::Prescribed;
+            out.paths.emplace_back(b.id, b.path);
+        }
+        out.time = bodies.time;
+    }
+
+    float Time() const override { return bodies.time; }
+
+    BodyStore<Space> bodies;
+
+private:
+    BodyHandles handles;
+    GravitySolver<Space> solver;
+    std::vector<Vec> forces;
+    float planeY;
+};
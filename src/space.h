@@ -0,0 +1,24 @@
+#pragma once
+#include <glm/glm.hpp>
+
+// Compile-time description of the space bodies move in. Kernels, integrators
+// and storage take one of these as a template parameter and work on Vec.
+
+// Unconstrained 3D motion.
+struct Space3D {
+    using Vec = glm::vec3;
+    static constexpr int dims = 3;
+
+    static Vec FromWorld(const glm::vec3& p) { return p; }
+    static glm::vec3 ToWorld(const Vec& v, float) { return v; }
+};
+
+// Motion confined to a horizontal plane y = const, as in the default scene.
+// Only (x, z) is stored and computed; the y lane does not exist.
+struct PlaneXZ {
+    using Vec = glm::vec2;
+    static constexpr int dims = 2;
+
+    static Vec FromWorld(const glm::vec3& p) { return Vec(p.x, p.z); }
+    static glm::vec3 ToWorld(const Vec& v, float planeY) { return glm::vec3(v.x, planeY, v.y); }
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include <glad/glad.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Unit sphere tessellated into an indexed triangle list in GPU buffers. On a
+// unit sphere the position is also the normal, so each vertex is one vec3,
+// fed to attribute location 0 by the mesh's vertex array object.
+struct SphereMesh {
+    GLuint vao = 0;
+    GLuint vbo = 0;
+    GLuint ibo = 0;
+    GLsizei indexCount = 0;
+};
+
+inline SphereMesh BuildSphereMesh(int slices, int stacks) {   //stacks => latitudes , slices => longitudes
+    std::vector<float> vertices;
+    vertices.reserve((stacks + 1) * (slices + 1) * 3);
+    for (int i = 0; i <= stacks; ++i) {
+        float lat = M_PI * (-0.5f + (float)i / stacks);
+        float z = sin(lat), zr = cos(lat);
+        for (int j = 0; j <= slices; ++j) {
+            float lng = 2 * M_PI * (float)j / slices;
+            vertices.push_back(cos(lng) * zr);
+            vertices.push_back(sin(lng) * zr);
+            vertices.push_back(z);
+        }
+    }
+
+    std::vector<GLuint> indices;
+    indices.reserve(stacks * slices * 6);
+    for (int i = 0; i < stacks; ++i) {
+        for (int j = 0; j < slices; ++j) {
+            GLuint a = i * (slices + 1) + j, b = a + slices + 1;
+            indices.insert(indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+        }
+    }
+
+    SphereMesh mesh;
+    glGenVertexArrays(1, &mesh.vao);
+    glBindVertexArray(mesh.vao);
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    glGenBuffers(1, &mesh.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    mesh.indexCount = (GLsizei)indices.size();
+    return mesh;
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "arena.h"
+#include "memory_stats.h"
+#include "profiler.h"
+
+// Fixed set of worker threads that run indexed tasks. The calling thread takes
+// part in every Run(), so a pool of size 1 runs everything inline.
+//
+// Every worker has a scratch arena for temporaries of the current step;
+// Scratch(0) belongs to the calling thread, also outside Run(). Users wrap
+// their allocations in an ArenaScope, and the owner of the step loop calls
+// ResetScratch() between steps so grown arenas settle into a single chunk.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = 0) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        scratch = std::make_unique<Arena[]>(threads);
+        for (unsigned w = 1; w < threads; ++w)
+            workers.emplace_back([this, w] { WorkerLoop(w); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned Size() const { return (unsigned)workers.size() + 1; }
+
+    Arena& Scratch(unsigned worker) { return scratch[worker]; }
+
+    // Only between Run() calls.
+    void ResetScratch() {
+        for (unsigned w = 0; w < Size(); ++w) scratch[w].Reset();
+    }
+
+    // Calls fn(task, worker) for every task in [0, count) and returns when all
+    // of them are done. Tasks are handed out on demand, so which worker runs a
+    // given task is not reproducible; worker is in [0, Size()).
+    template <class Fn>
+    void Run(size_t count, Fn&& fn) {
+        using F = std::remove_reference_t<Fn>;
+        if (count == 0) return;
+        if (workers.empty() || count == 1) {
+            for (size_t t = 0; t < count; ++t) fn(t, 0u);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job.call = [](void* ctx, size_t t, unsigned w) { (*static_cast<F*>(ctx))(t, w); };
+            job.ctx = const_cast<void*>(static_cast<const void*>(&fn));
+            job.count = count;
+            job.phase = CurrentMemoryPhase();
+            job.scope = Profiler::Get().Enabled() ? Profiler::Get().CurrentScope() : nullptr;
+            next.store(0, std::memory_order_relaxed);
+            pending = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+
+        Work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    struct Job {
+        void (*call)(void*, size_t, unsigned) = nullptr;
+        void* ctx = nullptr;
+        size_t count = 0;
+        MemoryPhase phase = MemoryPhase::Other;
+        const char* scope = nullptr; // caller's profiler scope, repeated on the workers
+    };
+
+    void Work(unsigned w) {
+        for (size_t t; (t = next.fetch_add(1, std::memory_order_relaxed)) < job.count; )
+            job.call(job.ctx, t, w);
+    }
+
+    void WorkerLoop(unsigned w) {
+        MemoryPhaseScope idle(MemoryPhase::Other);
+        if (Profiler::Get().Enabled()) Profiler::Get().NameThread("worker " + std::to_string(w));
+        size_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            {
+                MemoryPhaseScope phase(job.phase);
+                ProfileScope profile(job.scope ? job.scope : "pool task");
+                Work(w);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) done.notify_one();
+        }
+    }
+
+    std::unique_ptr<Arena[]> scratch;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    Job job;
+    std::atomic<size_t> next{0};
+    size_t pending = 0;
+    size_t generation = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,197 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include "gravity.h"
+#include "memory_stats.h"
+#include "profiler.h"
+#include "simulation.h"
+
+// Future path of a set of bodies: samples[b * samplesPerBody + k] is body
+// bodies[b] at time startTime + k * sampleInterval.
+struct Prediction {
+    uint64_t version = 0;
+    float startTime = 0.0f;
+    float sampleInterval = 0.0f;
+    size_t samplesPerBody = 0;
+    std::vector<size_t> bodies;
+    std::vector<glm::vec3> samples;
+};
+
+// Integrates copies of the simulation state ahead of time on its own thread.
+//
+// Request() hands over a snapshot and a selection and returns at once; the
+// worker integrates the whole system for `horizon` time units with a coarse
+// kick-drift-kick leapfrog (a few hundred steps, no thread pool) and records
+// the selected bodies. Each request gets a new version number, and the
+// worker abandons a run as soon as a newer version exists, so a stale
+// prediction is never finished, let alone published. Finished predictions
+// are picked up with Poll(). The mutex only guards buffer swaps, never the
+// integration, and Poll() only tries it, so neither the render loop nor the
+// simulation waits on the worker.
+class TrajectoryPredictor {
+public:
+    // Read by Request(), so changes apply from the next request on.
+    float horizon = 20.0f; // time units ahead
+    size_t steps = 800;    // integration steps over the horizon
+    size_t samples = 200;  // recorded points per body
+
+    TrajectoryPredictor() : worker([this] { WorkerLoop(); }) {}
+
+    ~TrajectoryPredictor() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        requested.fetch_add(1); // cancels the run in flight
+        wake.notify_one();
+        worker.join();
+    }
+
+    TrajectoryPredictor(const TrajectoryPredictor&) = delete;
+    TrajectoryPredictor& operator=(const TrajectoryPredictor&) = delete;
+
+    // Starts predicting from snapshot and cancels whatever is in flight.
+    // Takes the snapshot's contents without copying them and leaves an
+    // older snapshot in its place, whose storage GetSnapshot() can reuse.
+    // Returns the version the result will carry.
+    uint64_t Request(SimulationSnapshot& snapshot, const std::vector<size_t>& selected) {
+        std::swap(staged.snapshot, snapshot);
+        staged.selected = selected;
+        staged.horizon = horizon;
+        staged.steps = steps;
+        staged.samples = samples;
+        uint64_t version;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            version = staged.version = requested.fetch_add(1) + 1;
+            std::swap(staged, pending);
+            hasPending = true;
+        }
+        wake.notify_one();
+        return version;
+    }
+
+    // Sizes the snapshots and selections passed between Request() and the
+    // worker for the given body count, so requests made later do not allocate. Call before
+    // the first Request().
+    void Reserve(size_t bodies) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Job* job : { &staged, &pending, &running }) {
+            job->snapshot.Reserve(bodies);
+            job->selected.reserve(bodies);
+        }
+    }
+
+    // True while the latest request has not been published yet.
+    bool Busy() const { return published.load() != requested.load(); }
+
+    // Moves the newest finished prediction into out if there is one that
+    // out does not hold yet. Gives up instead of waiting if the worker is
+    // publishing at that moment.
+    bool Poll(Prediction& out) {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || ready.version <= out.version) return false;
+        std::swap(ready, out);
+        return true;
+    }
+
+private:
+    struct Job {
+        uint64_t version = 0;
+        SimulationSnapshot snapshot;
+        std::vector<size_t> selected;
+        float horizon = 0.0f;
+        size_t steps = 0, samples = 0;
+    };
+
+    void WorkerLoop() {
+        MemoryPhaseScope phase(MemoryPhase::Background);
+        if (Profiler::Get().Enabled()) Profiler::Get().NameThread("predictor");
+        Job& job = running;
+        Prediction result;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || hasPending; });
+                if (stopping) return;
+                std::swap(job, pending);
+                hasPending = false;
+            }
+            if (!Integrate(job, result)) continue;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                std::swap(ready, result);
+            }
+            published.store(job.version);
+        }
+    }
+
+    bool Cancelled(uint64_t version) const { return requested.load(std::memory_order_relaxed) != version; }
+
+    // Runs the job into out; false if a newer request arrived first.
+    bool Integrate(Job& job, Prediction& out) {
+        ProfileScope profile("predict");
+        SimulationSnapshot& s = job.snapshot;
+        size_t n = s.mass.size(), samples = std::max<size_t>(job.samples, 1);
+        size_t stepsPerSample = std::max<size_t>(job.steps / samples, 1);
+        float h = job.horizon / (float)(stepsPerSample * samples);
+        out.version = job.version;
+        out.startTime = s.time;
+        out.sampleInterval = h * (float)stepsPerSample;
+        out.samplesPerBody = samples;
+        out.bodies = job.selected;
+        out.samples.resize(job.selected.size() * samples);
+
+        acceleration.resize(n);
+        Accelerations(s);
+        float t = s.time;
+        for (size_t k = 0; k < samples; ++k) {
+            for (size_t b = 0; b < job.selected.size(); ++b)
+                out.samples[b * samples + k] = s.position[job.selected[b]];
+            if (Cancelled(job.version)) return false;
+            if (k + 1 == samples) break;
+            for (size_t step = 0; step < stepsPerSample; ++step) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (s.motion[i] != Motion::Dynamic) continue;
+                    s.velocity[i] += acceleration[i] * (0.5f * h);
+                    s.position[i] += s.velocity[i] * h;
+                }
+                t += h;
+                for (const auto& p : s.paths) s.position[p.first] = p.second.PositionAt(t);
+                Accelerations(s);
+                for (size_t i = 0; i < n; ++i)
+                    if (s.motion[i] == Motion::Dynamic) s.velocity[i] += acceleration[i] * (0.5f * h);
+            }
+        }
+        return true;
+    }
+
+    void Accelerations(const SimulationSnapshot& s) {
+        size_t n = s.mass.size();
+        for (size_t i = 0; i < n; ++i) {
+            glm::vec3 force(0.0f);
+            if (s.motion[i] == Motion::Dynamic) {
+                for (size_t j = 0; j < n; ++j)
+                    if (j != i) force += PairForce(s.position[i], s.mass[i], s.position[j], s.mass[j]);
+            }
+            acceleration[i] = force / s.mass[i];
+        }
+    }
+
+    std::vector<glm::vec3> acceleration;
+    Job staged, pending, running; // running is the worker's
+    Prediction ready;
+    bool hasPending = false, stopping = false;
+    std::atomic<uint64_t> requested{ 0 }, published{ 0 };
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread worker; // last, so it starts after everything it uses
+};